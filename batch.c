@@ -0,0 +1,167 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "misc.h"
+#include "node.h"
+
+/*
+ * The /.batch control file. Every write holds "top/reg=value" lines,
+ * blank lines and lines starting with '#' are skipped. All complete
+ * lines of a write are resolved first, then applied in submission
+ * order. A line split across writes is kept until the rest arrives, or
+ * until the file is flushed. Reading the file returns the line, applied
+ * and error counts followed by one "line: error" entry per failed line.
+ * With --writeback, lines are applied by queueing them.
+ */
+
+struct batch {
+	struct line_buf input;
+	uint32_t lines;
+	uint32_t applied;
+	uint32_t errors;
+	size_t log_len;
+	char log[BATCH_LOG_SIZE];
+};
+
+struct batch_op {
+	uint32_t line;
+	int reg;
+	int err;
+	uint64_t value;
+};
+
+struct batch_ctx {
+	struct soc_private *private;
+	struct batch *batch;
+	struct batch_op *ops;
+	uint32_t count;
+};
+
+struct batch *batch_new(void)
+{
+	return calloc(1, sizeof(struct batch));
+}
+
+void batch_free(struct batch *batch)
+{
+	free(batch);
+}
+
+/* Resolve a line into the next op, unless it holds nothing to apply */
+static int batch_parse(void *ctx, char *line, int err)
+{
+	struct batch_ctx *batch_ctx = ctx;
+	struct soc_private *private = batch_ctx->private;
+	struct batch_op *op = &batch_ctx->ops[batch_ctx->count];
+	char *value;
+
+	if (line) {
+		line = strip(line);
+		if (!*line || *line == '#')
+			return 0;
+	}
+
+	op->line = ++batch_ctx->batch->lines;
+	op->reg = -1;
+	op->err = err;
+	batch_ctx->count++;
+	if (err)
+		return 0;
+
+	value = strchr(line, '=');
+	if (!value) {
+		op->err = -EINVAL;
+		return 0;
+	}
+	*value++ = '\0';
+
+	line = strip(line);
+	if (*line == '/')
+		line++;
+
+	op->reg = index_find_reg(&private->index, &private->schema, line);
+	if (op->reg < 0)
+		op->err = -ENOENT;
+	else if (parse_input(strip(value), &op->value))
+		op->err = -EINVAL;
+
+	return 0;
+}
+
+static void batch_log(struct batch *batch, uint32_t line, int err)
+{
+	int len;
+
+	if (batch->log_len >= sizeof(batch->log) - 1)
+		return;
+
+	len = snprintf(batch->log + batch->log_len,
+		       sizeof(batch->log) - batch->log_len, "%u: %s\n", line,
+		       strerror(-err));
+	if (len > 0)
+		batch->log_len += len;
+	if (batch->log_len >= sizeof(batch->log))
+		batch->log_len = sizeof(batch->log) - 1;
+}
+
+static void batch_apply(struct batch_ctx *ctx)
+{
+	struct batch *batch = ctx->batch;
+	struct batch_op *op;
+	uint32_t i;
+
+	for (i = 0; i < ctx->count; i++) {
+		op = &ctx->ops[i];
+		if (!op->err)
+			op->err = writeback_write(ctx->private, op->reg,
+						  op->value);
+		if (op->err) {
+			batch->errors++;
+			batch_log(batch, op->line, op->err);
+		} else {
+			batch->applied++;
+		}
+	}
+}
+
+int batch_write(struct soc_private *private, struct batch *batch,
+		const char *buf, size_t size)
+{
+	struct batch_ctx ctx = { private, batch, NULL, 0 };
+	const char *pos, *end = buf + size, *nl;
+	uint32_t count = 0;
+
+	for (pos = buf; (nl = memchr(pos, '\n', end - pos)); pos = nl + 1)
+		count++;
+
+	ctx.ops = malloc((count + 1) * sizeof(*ctx.ops));
+	if (!ctx.ops)
+		return -ENOMEM;
+
+	/* Resolve every complete line up front, then apply them in order */
+	line_buf_split(&batch->input, buf, size, batch_parse, &ctx);
+	batch_apply(&ctx);
+	free(ctx.ops);
+
+	return size;
+}
+
+/* Apply a last line that wasn't terminated by a newline */
+int batch_flush(struct soc_private *private, struct batch *batch)
+{
+	struct batch_op op;
+	struct batch_ctx ctx = { private, batch, &op, 0 };
+
+	line_buf_finish(&batch->input, batch_parse, &ctx);
+	batch_apply(&ctx);
+
+	return 0;
+}
+
+int batch_show(struct batch *batch, char *buf, size_t size)
+{
+	return snprintf(buf, size, "lines: %u\napplied: %u\nerrors: %u\n%.*s",
+			batch->lines, batch->applied, batch->errors,
+			(int)batch->log_len, batch->log);
+}
@@ -0,0 +1,231 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "soc.h"
+
+/* Larger tops are read register by register, larger runs split */
+#define DUMP_MAX_SPAN	(16UL << 20)
+
+struct dump_entry {
+	uint64_t addr;
+	uint32_t reg;
+};
+
+struct dump_buf {
+	char *data;
+	size_t size;
+	size_t len;
+};
+
+static int entry_cmp(const void *a, const void *b)
+{
+	const struct dump_entry *x = a, *y = b;
+
+	if (x->addr != y->addr)
+		return x->addr < y->addr ? -1 : 1;
+	return x->reg < y->reg ? -1 : x->reg > y->reg;
+}
+
+static void append(struct dump_buf *buf, const char *fmt, ...)
+{
+	va_list ap;
+	int ret;
+
+	if (buf->len >= buf->size)
+		return;
+
+	va_start(ap, fmt);
+	ret = vsnprintf(buf->data + buf->len, buf->size - buf->len, fmt, ap);
+	va_end(ap);
+
+	if (ret > 0)
+		buf->len += ret;
+}
+
+/* Quoted JSON string, escaping is enough for register names */
+static void append_json(struct dump_buf *buf, const char *name)
+{
+	append(buf, "\"");
+	for (; *name && buf->len + 2 < buf->size; name++) {
+		if (*name == '"' || *name == '\\')
+			buf->data[buf->len++] = '\\';
+		buf->data[buf->len++] = *name;
+	}
+	append(buf, "\"");
+}
+
+/* Upper bound of the length of a top's dump */
+size_t dump_size(const struct soc_schema *schema, uint32_t top)
+{
+	const struct soc_top *t = &schema->tops[top];
+	size_t size = 2 * strlen(top_name(schema, top)) + 64;
+	uint32_t i;
+
+	for (i = 0; i < t->reg_count; i++)
+		size += 2 * strlen(reg_name(schema, t->first_reg + i)) + 96;
+
+	return size;
+}
+
+/*
+ * Format every register of a top in address order, as "name addr value"
+ * lines or as a JSON object. The top's whole address range is mapped
+ * once for the dump rather than register by register. Registers that
+ * can't be read show "-", or null in JSON.
+ */
+int dump_top(struct soc_private *private, uint32_t top, int json,
+	     char *data, size_t size)
+{
+	const struct soc_schema *schema = &private->schema;
+	const struct soc_top *t = &schema->tops[top];
+	struct reg_table *regs = &private->regs;
+	struct dump_buf buf = { data, size, 0 };
+	struct dump_entry *entries;
+	struct mem_ref map;
+	char *base = NULL;
+	uint64_t start = UINT64_MAX, end = 0, value;
+	uint32_t i, reg;
+	int readable;
+
+	entries = malloc((t->reg_count + 1) * sizeof(*entries));
+	if (!entries)
+		return -ENOMEM;
+
+	for (i = 0; i < t->reg_count; i++) {
+		reg = t->first_reg + i;
+		entries[i].addr = regs->addr[reg];
+		entries[i].reg = reg;
+		if (!(regs->flags[reg] & REG_READABLE))
+			continue;
+		if (regs->addr[reg] < start)
+			start = regs->addr[reg];
+		if (regs->addr[reg] + regs->width[reg] > end)
+			end = regs->addr[reg] + regs->width[reg];
+	}
+	qsort(entries, t->reg_count, sizeof(*entries), entry_cmp);
+
+	if (start < end && end - start <= DUMP_MAX_SPAN &&
+	    !mem_map(&private->mem, start, end - start, &map))
+		base = map.virt_addr;
+
+	if (json) {
+		append(&buf, "{\"name\": ");
+		append_json(&buf, top_name(schema, top));
+		append(&buf, ", \"registers\": [");
+	}
+
+	for (i = 0; i < t->reg_count; i++) {
+		reg = entries[i].reg;
+
+		/* Reading a read-clear register would lose its events */
+		readable = (regs->flags[reg] & REG_READABLE) &&
+			   !(regs->flags[reg] & REG_READ_CLEAR);
+		if (readable && base)
+			value = mem_read(base + (regs->addr[reg] - start),
+					 regs->width[reg]);
+		else if (readable)
+			readable = !reg_read(private, reg, &value);
+
+		if (json) {
+			append(&buf, "%s\n  {\"name\": ", i ? "," : "");
+			append_json(&buf, reg_name(schema, reg));
+			append(&buf, ", \"addr\": \"0x%" PRIx64 "\", ",
+			       regs->addr[reg]);
+			if (readable)
+				append(&buf, "\"value\": \"0x%" PRIx64 "\"}",
+				       value);
+			else
+				append(&buf, "\"value\": null}");
+		} else {
+			append(&buf, "%s 0x%" PRIx64 " ",
+			       reg_name(schema, reg), regs->addr[reg]);
+			if (readable)
+				append(&buf, "0x%" PRIx64 "\n", value);
+			else
+				append(&buf, "-\n");
+		}
+	}
+
+	if (json)
+		append(&buf, "\n]}\n");
+
+	if (base)
+		mem_put(&private->mem, &map);
+	free(entries);
+
+	return buf.len < size ? buf.len : size - 1;
+}
+
+size_t snapshot_size(const struct soc_schema *schema)
+{
+	return sizeof(struct soc_snapshot_header) +
+	       schema->reg_count * sizeof(uint64_t) +
+	       (schema->reg_count + 63) / 64 * sizeof(uint64_t);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Capture every register of the chip into the /.snapshot layout. All
+ * registers are mapped before the timed part, which then only performs
+ * the bus reads, back to back in address order.
+ */
+int snapshot_capture(struct soc_private *private, char *data, size_t size)
+{
+	struct reg_table *regs = &private->regs;
+	struct soc_snapshot_header *header = (void *)data;
+	uint64_t *values = (uint64_t *)(header + 1);
+	uint64_t *valid = values + regs->count;
+	struct reg_set set = { .regs = regs->order, .count = regs->count };
+	uint64_t *read, *read_valid;
+	uint32_t i, reg;
+	int ret;
+
+	if (size < snapshot_size(&private->schema))
+		return -EINVAL;
+
+	read = malloc((regs->count + 1) * sizeof(*read));
+	read_valid = calloc((regs->count + 63) / 64 + 1, sizeof(*read_valid));
+	ret = read && read_valid ? reg_set_map(private, &set) : -ENOMEM;
+	if (ret) {
+		free(read);
+		free(read_valid);
+		return ret;
+	}
+
+	memset(data, 0, snapshot_size(&private->schema));
+	header->magic = SOC_SNAPSHOT_MAGIC;
+	header->version = SOC_SNAPSHOT_VERSION;
+	header->reg_count = regs->count;
+	header->values_offset = sizeof(*header);
+
+	header->start_ns = now_ns();
+	reg_set_read(private, &set, read, read_valid);
+	header->end_ns = now_ns();
+
+	reg_set_unmap(private, &set);
+
+	/* Back from address order to register ids */
+	for (i = 0; i < regs->count; i++) {
+		if (!(read_valid[i / 64] & (1ULL << (i % 64))))
+			continue;
+		reg = regs->order[i];
+		values[reg] = read[i];
+		valid[reg / 64] |= 1ULL << (reg % 64);
+	}
+
+	free(read);
+	free(read_valid);
+
+	return snapshot_size(&private->schema);
+}
@@ -0,0 +1,273 @@
+/*
+  FUSE: Filesystem in Userspace
+  Copyright (C) 2020 Ramon Fried <rfried.dev@gmail.com>
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+/* Path based frontend, used with FUSE2 */
+
+#include "config.h"
+
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <assert.h>
+#include <sys/stat.h>
+#include "socfs.h"
+#include "node.h"
+
+/* Resolve a path one component at a time */
+static int path_to_node(struct soc_private *private, const char *path,
+			uint64_t *node)
+{
+	char name[PATH_MAX];
+	const char *end;
+	int ret;
+
+	*node = NODE_ROOT;
+
+	for (path++; *path; path = *end ? end + 1 : end) {
+		end = strchr(path, '/');
+		if (!end)
+			end = path + strlen(path);
+		if (end - path >= sizeof(name))
+			return -ENAMETOOLONG;
+
+		memcpy(name, path, end - path);
+		name[end - path] = '\0';
+
+		ret = node_lookup(private, *node, name, node);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int soc_getattr(const char *path, struct stat *stbuf)
+{
+	struct soc_private *private = fuse_get_context()->private_data;
+	uint64_t node;
+	int ret;
+
+	fuse_log(FUSE_LOG_DEBUG, "%s: %s\n", __func__, path);
+
+	ret = path_to_node(private, path, &node);
+	if (ret)
+		return ret;
+
+	return node_getattr(private, node, stbuf);
+}
+
+struct readdir_ctx {
+	void *buf;
+	fuse_fill_dir_t filler;
+};
+
+static int readdir_fill(void *ctx, const char *name, uint64_t node,
+			off_t next)
+{
+	struct readdir_ctx *readdir = ctx;
+
+	return readdir->filler(readdir->buf, name, NULL, 0);
+}
+
+static int soc_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                       off_t offset, struct fuse_file_info *fi)
+{
+	struct soc_private *private = fuse_get_context()->private_data;
+	struct readdir_ctx ctx = { buf, filler };
+	uint64_t node;
+	int ret;
+
+	fuse_log(FUSE_LOG_DEBUG, "%s: %s\n", __func__, path);
+
+	ret = path_to_node(private, path, &node);
+	if (ret) {
+		fuse_log(FUSE_LOG_ERR, "Couldn't find the file %s\n", path);
+		return ret;
+	}
+
+	return node_readdir(private, node, 0, readdir_fill, &ctx);
+}
+
+static int soc_read(const char *path, char *buf, size_t size, off_t offset,
+                    struct fuse_file_info *fi)
+{
+	struct soc_private *private = fuse_get_context()->private_data;
+	int ret;
+
+	fuse_log(FUSE_LOG_DEBUG, "%s: path: %s size: %zu offset: %jd\n",
+		 __func__, path, size, (intmax_t)offset);
+
+	ret = node_read(private, (struct node_handle *)(uintptr_t)fi->fh,
+			buf, size, offset);
+	if (ret == -EFAULT)
+		fuse_log(FUSE_LOG_ERR, "Can't read %s\n", path);
+
+	return ret;
+}
+
+static int soc_write(const char *path, const char *buf, size_t size,
+		     off_t offset, struct fuse_file_info *fi)
+{
+	struct soc_private *private = fuse_get_context()->private_data;
+	int ret;
+
+	fuse_log(FUSE_LOG_DEBUG, "%s: %s\n", __func__, path);
+
+	ret = node_write(private, (struct node_handle *)(uintptr_t)fi->fh,
+			 buf, size, offset);
+	if (ret == -EINVAL)
+		fuse_log(FUSE_LOG_ERR, "Can't parse write value\n");
+
+	return ret;
+}
+
+/*
+ * The register is resolved and mapped once here, reads and writes then
+ * go straight through the handle. File contents are live register
+ * values and bypass the page cache, unless the node captured them at
+ * open.
+ */
+static int soc_open(const char *path, struct fuse_file_info *fi)
+{
+	struct soc_private *private = fuse_get_context()->private_data;
+	struct node_handle *handle;
+	uint64_t node;
+	int ret;
+
+	fuse_log(FUSE_LOG_DEBUG, "%s: %s\n", __func__, path);
+
+	ret = path_to_node(private, path, &node);
+	if (!ret)
+		ret = node_open(private, node, fi->flags, &handle);
+	if (ret)
+		return ret;
+
+	fi->fh = (uintptr_t)handle;
+	fi->direct_io = handle->direct_io;
+	return 0;
+}
+
+static int soc_flush(const char *path, struct fuse_file_info *fi)
+{
+	struct soc_private *private = fuse_get_context()->private_data;
+
+	return node_flush(private, (struct node_handle *)(uintptr_t)fi->fh);
+}
+
+static int soc_release(const char *path, struct fuse_file_info *fi)
+{
+	struct soc_private *private = fuse_get_context()->private_data;
+
+	node_release(private, (struct node_handle *)(uintptr_t)fi->fh);
+	return 0;
+}
+
+/* Directories carry no open handle, only register files use it */
+static int soc_ioctl(const char *path, int cmd, void *arg,
+		     struct fuse_file_info *fi, unsigned int flags, void *data)
+{
+	struct soc_private *private = fuse_get_context()->private_data;
+	struct node_handle *handle = NULL;
+	uint64_t node;
+	int ret;
+
+	fuse_log(FUSE_LOG_DEBUG, "%s: %s\n", __func__, path);
+
+	ret = path_to_node(private, path, &node);
+	if (ret)
+		return ret;
+
+	if (!(flags & FUSE_IOCTL_DIR))
+		handle = (struct node_handle *)(uintptr_t)fi->fh;
+
+	return node_ioctl(private, node, handle, cmd, data);
+}
+
+static int soc_poll(const char *path, struct fuse_file_info *fi,
+		    struct fuse_pollhandle *ph, unsigned *reventsp)
+{
+	struct soc_private *private = fuse_get_context()->private_data;
+
+	return node_poll(private, (struct node_handle *)(uintptr_t)fi->fh, ph,
+			 reventsp);
+}
+
+static void poll_notify(void *ph)
+{
+	fuse_notify_poll(ph);
+	fuse_pollhandle_destroy(ph);
+}
+
+static void poll_destroy(void *ph)
+{
+	fuse_pollhandle_destroy(ph);
+}
+
+static int soc_fsync(const char *path, int datasync,
+		     struct fuse_file_info *fi)
+{
+	struct soc_private *private = fuse_get_context()->private_data;
+
+	return node_fsync(private, (struct node_handle *)(uintptr_t)fi->fh);
+}
+
+/* The session is going away, stop notifying it and apply queued writes */
+static void soc_destroy(void *private_data)
+{
+	watch_stop(private_data);
+	writeback_stop(private_data);
+}
+
+static int soc_truncate(const char *path, off_t offset)
+{
+	fuse_log(FUSE_LOG_DEBUG, "%s: %s\n", __func__, path);
+	return 0;
+}
+
+static struct fuse_operations soc_oper = {
+	.getattr	= soc_getattr,
+	.readdir	= soc_readdir,
+	.open		= soc_open,
+	.flush		= soc_flush,
+	.release	= soc_release,
+	.fsync		= soc_fsync,
+	.read		= soc_read,
+	.write		= soc_write,
+	.truncate	= soc_truncate,
+	.ioctl		= soc_ioctl,
+	.poll		= soc_poll,
+	.destroy	= soc_destroy,
+};
+
+void fuse_frontend_help(struct fuse_args *args)
+{
+	/* Signal fuse_main to show additional help (by adding `--help`
+	   to the options again) without usage: line (by setting argv[0]
+	   to the empty string) */
+	assert(fuse_opt_add_arg(args, "--help") == 0);
+	args->argv[0][0] = '\0';
+	fuse_main(args->argc, args->argv, &soc_oper, NULL);
+}
+
+int fuse_frontend_main(struct fuse_args *args, struct soc_private *private)
+{
+	char timeouts[96];
+
+	/* Inserted ahead of the user's own -o options, which take precedence */
+	snprintf(timeouts, sizeof(timeouts),
+		 "-oentry_timeout=%u,attr_timeout=%u,negative_timeout=%u",
+		 private->cache_timeout, private->cache_timeout,
+		 private->cache_timeout);
+	if (fuse_opt_insert_arg(args, 1, timeouts))
+		return 1;
+
+	if (watch_init(private, poll_notify, poll_destroy))
+		return 1;
+
+	return fuse_main(args->argc, args->argv, &soc_oper, private);
+}
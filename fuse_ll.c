@@ -0,0 +1,375 @@
+/*
+  FUSE: Filesystem in Userspace
+  Copyright (C) 2020 Ramon Fried <rfried.dev@gmail.com>
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+/*
+ * Low level frontend, used with FUSE3. Node numbers are the inode
+ * numbers, so a path is resolved one name at a time by lookup and every
+ * later operation indexes straight into the register table.
+ */
+
+#include "config.h"
+
+#include "socfs.h"
+
+#include <fuse_lowlevel.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "node.h"
+#include "socfs_ioctl.h"
+
+static void soc_ll_lookup(fuse_req_t req, fuse_ino_t parent,
+			  const char *name)
+{
+	struct soc_private *private = fuse_req_userdata(req);
+	struct fuse_entry_param e;
+	uint64_t node;
+	int ret;
+
+	fuse_log(FUSE_LOG_DEBUG, "%s: %s\n", __func__, name);
+
+	memset(&e, 0, sizeof(e));
+	e.attr_timeout = private->cache_timeout;
+	e.entry_timeout = private->cache_timeout;
+
+	ret = node_lookup(private, parent, name, &node);
+	if (ret == -ENOENT) {
+		/* A zero inode makes the kernel cache the miss */
+		fuse_reply_entry(req, &e);
+		return;
+	}
+	if (!ret)
+		ret = node_getattr(private, node, &e.attr);
+	if (ret) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+
+	e.ino = node;
+	fuse_reply_entry(req, &e);
+}
+
+static void soc_ll_getattr(fuse_req_t req, fuse_ino_t ino,
+			   struct fuse_file_info *fi)
+{
+	struct soc_private *private = fuse_req_userdata(req);
+	struct stat stbuf;
+	int ret;
+
+	ret = node_getattr(private, ino, &stbuf);
+	if (ret)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_attr(req, &stbuf, private->cache_timeout);
+}
+
+/* Register files have nothing to truncate, so only report the attributes */
+static void soc_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+			   int to_set, struct fuse_file_info *fi)
+{
+	soc_ll_getattr(req, ino, fi);
+}
+
+struct readdir_ctx {
+	fuse_req_t req;
+	char *buf;
+	size_t size;
+	size_t used;
+};
+
+static int readdir_fill(void *ctx, const char *name, uint64_t node,
+			off_t next)
+{
+	struct readdir_ctx *readdir = ctx;
+	struct soc_private *private = fuse_req_userdata(readdir->req);
+	struct stat stbuf;
+	size_t len;
+
+	memset(&stbuf, 0, sizeof(stbuf));
+	stbuf.st_ino = node;
+	stbuf.st_mode = node_is_dir(private, node) ? S_IFDIR : S_IFREG;
+
+	len = fuse_add_direntry(readdir->req, readdir->buf + readdir->used,
+				readdir->size - readdir->used, name, &stbuf,
+				next);
+	if (len > readdir->size - readdir->used)
+		return 1;
+
+	readdir->used += len;
+	return 0;
+}
+
+static void soc_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+			   off_t offset, struct fuse_file_info *fi)
+{
+	struct soc_private *private = fuse_req_userdata(req);
+	struct readdir_ctx ctx = { req, NULL, size, 0 };
+	int ret;
+
+	fuse_log(FUSE_LOG_DEBUG, "%s: %ju offset: %jd\n", __func__,
+		 (uintmax_t)ino, (intmax_t)offset);
+
+	ctx.buf = malloc(size);
+	if (!ctx.buf) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	ret = node_readdir(private, ino, offset, readdir_fill, &ctx);
+	if (ret)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_buf(req, ctx.buf, ctx.used);
+
+	free(ctx.buf);
+}
+
+/* Listings never change, so let the kernel keep them across opens */
+static void soc_ll_opendir(fuse_req_t req, fuse_ino_t ino,
+			   struct fuse_file_info *fi)
+{
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 5)
+	fi->cache_readdir = 1;
+	fi->keep_cache = 1;
+#endif
+	fuse_reply_open(req, fi);
+}
+
+/*
+ * The register is resolved and mapped once here, reads and writes then
+ * go straight through the handle. File contents are live register
+ * values and bypass the page cache, unless the node captured them at
+ * open.
+ */
+static void soc_ll_open(fuse_req_t req, fuse_ino_t ino,
+			struct fuse_file_info *fi)
+{
+	struct soc_private *private = fuse_req_userdata(req);
+	struct node_handle *handle;
+	int ret;
+
+	ret = node_open(private, ino, fi->flags, &handle);
+	if (ret) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+
+	fi->fh = (uintptr_t)handle;
+	fi->direct_io = handle->direct_io;
+	fuse_reply_open(req, fi);
+}
+
+static void soc_ll_flush(fuse_req_t req, fuse_ino_t ino,
+			 struct fuse_file_info *fi)
+{
+	struct soc_private *private = fuse_req_userdata(req);
+	struct node_handle *handle = (struct node_handle *)(uintptr_t)fi->fh;
+
+	fuse_reply_err(req, -node_flush(private, handle));
+}
+
+static void soc_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+			 struct fuse_file_info *fi)
+{
+	struct soc_private *private = fuse_req_userdata(req);
+	struct node_handle *handle = (struct node_handle *)(uintptr_t)fi->fh;
+
+	fuse_reply_err(req, -node_fsync(private, handle));
+}
+
+static void soc_ll_release(fuse_req_t req, fuse_ino_t ino,
+			   struct fuse_file_info *fi)
+{
+	struct soc_private *private = fuse_req_userdata(req);
+
+	node_release(private, (struct node_handle *)(uintptr_t)fi->fh);
+	fuse_reply_err(req, 0);
+}
+
+static void soc_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+			off_t offset, struct fuse_file_info *fi)
+{
+	struct soc_private *private = fuse_req_userdata(req);
+	struct node_handle *handle = (struct node_handle *)(uintptr_t)fi->fh;
+	char *buf;
+	int ret;
+
+	fuse_log(FUSE_LOG_DEBUG, "%s: %ju size: %zu offset: %jd\n", __func__,
+		 (uintmax_t)ino, size, (intmax_t)offset);
+
+	buf = malloc(size ? size : 1);
+	if (!buf) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	ret = node_read(private, handle, buf, size, offset);
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_buf(req, buf, ret);
+
+	free(buf);
+}
+
+static void soc_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+			 size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	struct soc_private *private = fuse_req_userdata(req);
+	struct node_handle *handle = (struct node_handle *)(uintptr_t)fi->fh;
+	int ret;
+
+	fuse_log(FUSE_LOG_DEBUG, "%s: %ju size: %zu\n", __func__,
+		 (uintmax_t)ino, size);
+
+	ret = node_write(private, handle, buf, size, offset);
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_write(req, ret);
+}
+
+static void soc_ll_poll(fuse_req_t req, fuse_ino_t ino,
+			struct fuse_file_info *fi, struct fuse_pollhandle *ph)
+{
+	struct soc_private *private = fuse_req_userdata(req);
+	struct node_handle *handle = (struct node_handle *)(uintptr_t)fi->fh;
+	unsigned int revents;
+	int ret;
+
+	ret = node_poll(private, handle, ph, &revents);
+	if (ret)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_poll(req, revents);
+}
+
+static void poll_notify(void *ph)
+{
+	fuse_lowlevel_notify_poll(ph);
+	fuse_pollhandle_destroy(ph);
+}
+
+static void poll_destroy(void *ph)
+{
+	fuse_pollhandle_destroy(ph);
+}
+
+/*
+ * Only restricted ioctls reach a FUSE file system, so the kernel has
+ * already copied in the whole argument, sized by the command.
+ */
+static void soc_ll_ioctl(fuse_req_t req, fuse_ino_t ino, int cmd, void *arg,
+			 struct fuse_file_info *fi, unsigned flags,
+			 const void *in_buf, size_t in_bufsz, size_t out_bufsz)
+{
+	struct soc_private *private = fuse_req_userdata(req);
+	struct node_handle *handle = NULL;
+	struct socfs_ioc ioc;
+	int ret;
+
+	fuse_log(FUSE_LOG_DEBUG, "%s: %ju cmd: %x\n", __func__,
+		 (uintmax_t)ino, (unsigned int)cmd);
+
+	if ((unsigned int)cmd != SOCFS_IOC_OPS) {
+		fuse_reply_err(req, ENOTTY);
+		return;
+	}
+	if (in_bufsz != sizeof(ioc) || out_bufsz != sizeof(ioc)) {
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+
+	if (!(flags & FUSE_IOCTL_DIR))
+		handle = (struct node_handle *)(uintptr_t)fi->fh;
+
+	memcpy(&ioc, in_buf, sizeof(ioc));
+	ret = node_ioctl(private, ino, handle, cmd, &ioc);
+	if (ret)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_ioctl(req, 0, &ioc, sizeof(ioc));
+}
+
+static const struct fuse_lowlevel_ops soc_ll_oper = {
+	.lookup		= soc_ll_lookup,
+	.getattr	= soc_ll_getattr,
+	.setattr	= soc_ll_setattr,
+	.opendir	= soc_ll_opendir,
+	.readdir	= soc_ll_readdir,
+	.open		= soc_ll_open,
+	.flush		= soc_ll_flush,
+	.release	= soc_ll_release,
+	.fsync		= soc_ll_fsync,
+	.read		= soc_ll_read,
+	.write		= soc_ll_write,
+	.ioctl		= soc_ll_ioctl,
+	.poll		= soc_ll_poll,
+};
+
+void fuse_frontend_help(struct fuse_args *args)
+{
+	fuse_cmdline_help();
+	fuse_lowlevel_help();
+}
+
+int fuse_frontend_main(struct fuse_args *args, struct soc_private *private)
+{
+	struct fuse_cmdline_opts opts;
+	struct fuse_session *se;
+	int ret = 1;
+
+	if (fuse_parse_cmdline(args, &opts) != 0)
+		return 1;
+
+	if (opts.show_version) {
+		printf("FUSE library version %s\n", fuse_pkgversion());
+		fuse_lowlevel_version();
+		ret = 0;
+		goto err_out1;
+	}
+
+	if (!opts.mountpoint) {
+		printf("Error: no mountpoint specified\n");
+		goto err_out1;
+	}
+
+	if (watch_init(private, poll_notify, poll_destroy))
+		goto err_out1;
+
+	se = fuse_session_new(args, &soc_ll_oper, sizeof(soc_ll_oper),
+			      private);
+	if (!se)
+		goto err_out1;
+
+	if (fuse_set_signal_handlers(se) != 0)
+		goto err_out2;
+
+	if (fuse_session_mount(se, opts.mountpoint) != 0)
+		goto err_out3;
+
+	fuse_daemonize(opts.foreground);
+
+	if (opts.singlethread)
+		ret = fuse_session_loop(se);
+	else
+		ret = fuse_session_loop_mt(se, opts.clone_fd);
+
+	watch_stop(private);
+	writeback_stop(private);
+	fuse_session_unmount(se);
+err_out3:
+	fuse_remove_signal_handlers(se);
+err_out2:
+	fuse_session_destroy(se);
+err_out1:
+	free(opts.mountpoint);
+
+	return ret ? 1 : 0;
+}
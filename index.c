@@ -0,0 +1,236 @@
+#include <stdlib.h>
+#include <string.h>
+#include "soc.h"
+
+#define FNV_OFFSET_BASIS	0xcbf29ce484222325ULL
+#define FNV_PRIME		0x100000001b3ULL
+
+static uint64_t fnv1a(uint64_t hash, const char *s, size_t len)
+{
+	while (len--) {
+		hash ^= (unsigned char)*s++;
+		hash *= FNV_PRIME;
+	}
+
+	return hash;
+}
+
+/* MurmurHash3 finalizer, spreads the seeded hash over the PHF slots */
+static uint64_t fmix64(uint64_t hash)
+{
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	hash *= 0xc4ceb9fe1a85ec53ULL;
+	hash ^= hash >> 33;
+
+	return hash;
+}
+
+/* Returns the value stored for a key with the given hash, if any */
+static uint32_t phf_lookup(const struct soc_phf *phf, uint64_t hash)
+{
+	uint32_t seed = phf->seeds[hash % phf->bucket_count];
+	uint32_t slot;
+
+	if (seed & SOC_PHF_DIRECT)
+		slot = seed & ~SOC_PHF_DIRECT;
+	else
+		slot = fmix64(hash ^ seed * SOC_PHF_SEED_MULT) %
+		       phf->slot_count;
+
+	if (slot >= phf->slot_count)
+		return INDEX_EMPTY;
+
+	return phf->seeds[phf->bucket_count + slot];
+}
+
+/* Smallest power of two keeping the table at most half full */
+static uint32_t table_size(uint32_t count)
+{
+	uint32_t size = 16;
+
+	while (size < count * 2)
+		size <<= 1;
+
+	return size;
+}
+
+static void table_insert(struct index_entry *table, uint32_t mask,
+			 uint64_t hash, uint32_t top, uint32_t reg)
+{
+	uint32_t i = hash & mask;
+
+	while (table[i].top != INDEX_EMPTY)
+		i = (i + 1) & mask;
+
+	table[i].hash = hash;
+	table[i].top = top;
+	table[i].reg = reg;
+}
+
+static struct index_entry *table_alloc(uint32_t count, uint32_t *mask)
+{
+	uint32_t size = table_size(count);
+	struct index_entry *table;
+
+	table = malloc(size * sizeof(*table));
+	if (table)
+		memset(table, 0xff, size * sizeof(*table));
+	*mask = size - 1;
+
+	return table;
+}
+
+int index_build(struct soc_index *index, const struct soc_schema *schema)
+{
+	uint64_t hash;
+	uint32_t i, j;
+
+	/* The SOC file carries its own index */
+	if (schema->phf)
+		return 0;
+
+	index->tops = table_alloc(schema->top_count, &index->tops_mask);
+	index->regs = table_alloc(schema->reg_count, &index->regs_mask);
+	if (!index->tops || !index->regs)
+		return -1;
+
+	for (i = 0; i < schema->top_count; i++) {
+		const struct soc_top *top = &schema->tops[i];
+		const char *name = top_name(schema, i);
+
+		hash = fnv1a(FNV_OFFSET_BASIS, name, strlen(name));
+		table_insert(index->tops, index->tops_mask, hash, i,
+			     INDEX_EMPTY);
+
+		hash = fnv1a(hash, "/", 1);
+		for (j = top->first_reg; j < top->first_reg + top->reg_count;
+		     j++) {
+			name = reg_name(schema, j);
+			table_insert(index->regs, index->regs_mask,
+				     fnv1a(hash, name, strlen(name)), i, j);
+		}
+	}
+
+	return 0;
+}
+
+static int name_matches(const char *name, const char *s, size_t len)
+{
+	return !strncmp(name, s, len) && name[len] == '\0';
+}
+
+static int find_top(const struct soc_index *index,
+		    const struct soc_schema *schema, uint64_t hash,
+		    const char *name, size_t len)
+{
+	uint32_t i, top;
+
+	if (schema->phf) {
+		top = phf_lookup(schema->phf, hash);
+		if (!(top & SOC_PHF_TOP))
+			return -1;
+		top &= ~SOC_PHF_TOP;
+		if (top < schema->top_count &&
+		    name_matches(top_name(schema, top), name, len))
+			return top;
+		return -1;
+	}
+
+	for (i = hash & index->tops_mask; index->tops[i].top != INDEX_EMPTY;
+	     i = (i + 1) & index->tops_mask)
+		if (index->tops[i].hash == hash &&
+		    name_matches(top_name(schema, index->tops[i].top),
+				 name, len))
+			return index->tops[i].top;
+
+	return -1;
+}
+
+int index_find_top(const struct soc_index *index,
+		   const struct soc_schema *schema, const char *name,
+		   size_t len)
+{
+	return find_top(index, schema, fnv1a(FNV_OFFSET_BASIS, name, len),
+			name, len);
+}
+
+/* Looks up a register by name inside the given top */
+int index_find_child(const struct soc_index *index,
+		     const struct soc_schema *schema, uint32_t top,
+		     const char *name)
+{
+	const char *tname = top_name(schema, top);
+	const struct soc_top *t = &schema->tops[top];
+	uint64_t hash;
+	uint32_t i, reg;
+
+	hash = fnv1a(FNV_OFFSET_BASIS, tname, strlen(tname));
+	hash = fnv1a(hash, "/", 1);
+	hash = fnv1a(hash, name, strlen(name));
+
+	if (schema->phf) {
+		reg = phf_lookup(schema->phf, hash);
+		if ((reg & SOC_PHF_TOP) || reg < t->first_reg ||
+		    reg - t->first_reg >= t->reg_count ||
+		    strcmp(reg_name(schema, reg), name))
+			return -1;
+		return reg;
+	}
+
+	for (i = hash & index->regs_mask; index->regs[i].top != INDEX_EMPTY;
+	     i = (i + 1) & index->regs_mask) {
+		const struct index_entry *entry = &index->regs[i];
+
+		if (entry->hash == hash && entry->top == top &&
+		    !strcmp(reg_name(schema, entry->reg), name))
+			return entry->reg;
+	}
+
+	return -1;
+}
+
+/* path is "top/reg", without the leading slash */
+int index_find_reg(const struct soc_index *index,
+		   const struct soc_schema *schema, const char *path)
+{
+	const char *sep = strchr(path, '/');
+	uint64_t top_hash, hash;
+	uint32_t i, reg;
+	int top;
+
+	if (!sep)
+		return -1;
+
+	top_hash = fnv1a(FNV_OFFSET_BASIS, path, sep - path);
+	hash = fnv1a(top_hash, sep, strlen(sep));
+
+	if (schema->phf) {
+		reg = phf_lookup(schema->phf, hash);
+		if ((reg & SOC_PHF_TOP) || reg >= schema->reg_count ||
+		    strcmp(reg_name(schema, reg), sep + 1))
+			return -1;
+
+		/* The name matched, make sure it's under the right top */
+		top = find_top(index, schema, top_hash, path, sep - path);
+		if (top < 0 || reg < schema->tops[top].first_reg ||
+		    reg - schema->tops[top].first_reg >=
+		    schema->tops[top].reg_count)
+			return -1;
+		return reg;
+	}
+
+	for (i = hash & index->regs_mask; index->regs[i].top != INDEX_EMPTY;
+	     i = (i + 1) & index->regs_mask) {
+		const struct index_entry *entry = &index->regs[i];
+
+		if (entry->hash == hash &&
+		    name_matches(top_name(schema, entry->top), path,
+				 sep - path) &&
+		    !strcmp(reg_name(schema, entry->reg), sep + 1))
+			return entry->reg;
+	}
+
+	return -1;
+}
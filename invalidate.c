@@ -0,0 +1,110 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "misc.h"
+#include "node.h"
+
+/*
+ * The /.invalidate control file. Every line written drops cached
+ * register values: "top/reg" those of one register, "top" those of a
+ * top's registers and "*" all of them. The next read of the registers
+ * goes to the hardware again; write-only registers lose their shadow.
+ * A write holding a line that names nothing fails with ENOENT, after the
+ * other lines were applied.
+ */
+
+struct invalidate {
+	struct line_buf input;
+	int err;
+};
+
+struct invalidate_ctx {
+	struct soc_private *private;
+	struct invalidate *invalidate;
+};
+
+struct invalidate *invalidate_new(void)
+{
+	return calloc(1, sizeof(struct invalidate));
+}
+
+void invalidate_free(struct invalidate *invalidate)
+{
+	free(invalidate);
+}
+
+static int invalidate_line(void *ctx, char *line, int err)
+{
+	struct invalidate_ctx *invalidate_ctx = ctx;
+	struct soc_private *private = invalidate_ctx->private;
+	const struct soc_top *top;
+	uint32_t i, first = 0, count = 0;
+	int id;
+
+	if (!err) {
+		line = strip(line);
+		if (*line == '/')
+			line++;
+		if (!*line)
+			return 0;
+
+		if (!strcmp(line, "*")) {
+			count = private->regs.count;
+		} else if (strchr(line, '/')) {
+			id = index_find_reg(&private->index, &private->schema,
+					    line);
+			first = id;
+			count = id >= 0;
+		} else {
+			id = index_find_top(&private->index, &private->schema,
+					    line, strlen(line));
+			if (id >= 0) {
+				top = &private->schema.tops[id];
+				first = top->first_reg;
+				count = top->reg_count;
+			}
+		}
+		if (!count)
+			err = -ENOENT;
+	}
+
+	for (i = 0; i < count; i++)
+		reg_invalidate(&private->regs, first + i);
+
+	if (err && !invalidate_ctx->invalidate->err)
+		invalidate_ctx->invalidate->err = err;
+
+	return 0;
+}
+
+static int invalidate_result(struct invalidate *invalidate)
+{
+	int ret = invalidate->err;
+
+	invalidate->err = 0;
+	return ret;
+}
+
+int invalidate_write(struct soc_private *private,
+		     struct invalidate *invalidate, const char *buf,
+		     size_t size)
+{
+	struct invalidate_ctx ctx = { private, invalidate };
+	int ret;
+
+	line_buf_split(&invalidate->input, buf, size, invalidate_line, &ctx);
+	ret = invalidate_result(invalidate);
+
+	return ret ? ret : size;
+}
+
+/* Apply a last line that wasn't terminated by a newline */
+int invalidate_flush(struct soc_private *private,
+		     struct invalidate *invalidate)
+{
+	struct invalidate_ctx ctx = { private, invalidate };
+
+	line_buf_finish(&invalidate->input, invalidate_line, &ctx);
+
+	return invalidate_result(invalidate);
+}
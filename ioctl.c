@@ -0,0 +1,103 @@
+#include <errno.h>
+#include "soc.h"
+#include "socfs_ioctl.h"
+
+/*
+ * Execution of SOCFS_IOC_OPS. Registers are addressed by id or by
+ * address, which is looked up in the register table so only known
+ * registers can be reached. The register of the file the ioctl was
+ * issued on goes through its open handle, everything else through the
+ * mapping cache.
+ */
+
+static int op_read(struct soc_private *private, struct reg_handle *self,
+		   uint32_t reg, uint64_t *value)
+{
+	/* Write-only registers read back their shadow, like their files */
+	if (!(private->regs.flags[reg] & REG_READABLE))
+		return reg_shadow(&private->regs, reg, value);
+
+	if (self && self->reg == reg)
+		return reg_handle_read(self, value);
+
+	return reg_read(private, reg, value);
+}
+
+static int op_write(struct soc_private *private, struct reg_handle *self,
+		    uint32_t reg, uint64_t value)
+{
+	if (self && self->reg == reg)
+		return reg_handle_write(self, value);
+
+	return reg_write(private, reg, value);
+}
+
+static int op_update(struct soc_private *private, struct reg_handle *self,
+		     uint32_t reg, uint64_t mask, uint64_t bits,
+		     uint64_t *result)
+{
+	if (self && self->reg == reg)
+		return reg_handle_update(self, mask, bits, result);
+
+	return reg_update(private, reg, mask, bits, result);
+}
+
+static int op_exec(struct soc_private *private, struct reg_handle *self,
+		   struct socfs_op *op)
+{
+	struct reg_table *regs = &private->regs;
+	int reg;
+
+	if (op->flags & ~SOCFS_OP_ADDR)
+		return -EINVAL;
+
+	if (op->op == SOCFS_OP_BARRIER) {
+		mem_barrier();
+		return 0;
+	}
+
+	if (op->flags & SOCFS_OP_ADDR)
+		reg = reg_find_addr(regs, op->addr);
+	else if (op->reg == SOCFS_REG_SELF)
+		reg = self ? (int)self->reg : -1;
+	else
+		reg = op->reg < regs->count ? (int)op->reg : -1;
+	if (reg < 0)
+		return -ENOENT;
+
+	if (op->width && op->width != regs->width[reg])
+		return -EINVAL;
+
+	switch (op->op) {
+	case SOCFS_OP_READ:
+		return op_read(private, self, reg, &op->value);
+	case SOCFS_OP_WRITE:
+		return op_write(private, self, reg, op->value);
+	case SOCFS_OP_SET:
+		return op_update(private, self, reg, op->value, op->value,
+				 &op->value);
+	case SOCFS_OP_CLEAR:
+		return op_update(private, self, reg, op->value, 0, &op->value);
+	default:
+		return -EINVAL;
+	}
+}
+
+/* self is the handle of the register file the ioctl came in on, if any */
+int reg_ops(struct soc_private *private, struct reg_handle *self,
+	    struct socfs_ioc *ioc)
+{
+	struct socfs_op *op;
+
+	if (ioc->count > SOCFS_IOC_MAX_OPS)
+		return -EINVAL;
+
+	for (ioc->done = 0; ioc->done < ioc->count; ioc->done++) {
+		op = &ioc->ops[ioc->done];
+		op->status = op_exec(private, self, op);
+		if (op->status)
+			break;
+	}
+
+	return 0;
+}
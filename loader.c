@@ -0,0 +1,243 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "soc.h"
+
+static const struct soc_section *find_section(const struct soc_header *header,
+					      uint32_t type)
+{
+	uint32_t i;
+
+	for (i = 0; i < header->section_count; i++)
+		if (header->sections[i].type == type)
+			return &header->sections[i];
+
+	return NULL;
+}
+
+static const void *section_data(const void *file, size_t size,
+				const struct soc_section *section,
+				uint64_t min_size)
+{
+	if (!section || section->offset > size ||
+	    section->size > size - section->offset ||
+	    section->size < min_size || section->offset % 8)
+		return NULL;
+
+	return (const char *)file + section->offset;
+}
+
+static const struct soc_phf *load_phf(const struct soc_schema *schema,
+				      const void *file, size_t size,
+				      const struct soc_section *section)
+{
+	const struct soc_phf *phf;
+
+	phf = section_data(file, size, section, sizeof(*phf));
+	if (!phf)
+		return NULL;
+
+	if (!phf->bucket_count ||
+	    phf->slot_count != schema->top_count + schema->reg_count ||
+	    ((uint64_t)phf->bucket_count + phf->slot_count) *
+	    sizeof(uint32_t) > section->size - sizeof(*phf))
+		return NULL;
+
+	return phf;
+}
+
+static int load_fields(struct soc_schema *schema, const void *file,
+		       size_t size, const struct soc_section *section)
+{
+	const struct soc_field *field;
+	uint32_t i;
+
+	schema->fields = section_data(file, size, section, 0);
+	if (!schema->fields || section->size % sizeof(struct soc_field))
+		return -EINVAL;
+	schema->field_count = section->size / sizeof(struct soc_field);
+
+	for (i = 0; i < schema->field_count; i++) {
+		field = &schema->fields[i];
+
+		/* Sorted by register, so a register's fields are contiguous */
+		if (field->name >= schema->strings_size ||
+		    field->reg >= schema->reg_count ||
+		    (i && field->reg < schema->fields[i - 1].reg) ||
+		    !field->width || field->width > 64 ||
+		    field->lsb + field->width > schema->regs[field->reg].width)
+			return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int load_v2(struct soc_schema *schema, const void *file, size_t size)
+{
+	const struct soc_header *header = file;
+	const struct soc_section *strings, *phf, *fields;
+	uint32_t i;
+
+	if (size < sizeof(*header) ||
+	    header->section_count > (size - sizeof(*header)) /
+				    sizeof(struct soc_section))
+		return -EINVAL;
+
+	strings = find_section(header, SOC_SECTION_STRINGS);
+	schema->strings = section_data(file, size, strings, 1);
+	schema->tops = section_data(file, size,
+				    find_section(header, SOC_SECTION_TOPS),
+				    (uint64_t)header->top_count *
+				    sizeof(struct soc_top));
+	schema->regs = section_data(file, size,
+				    find_section(header, SOC_SECTION_REGS),
+				    (uint64_t)header->reg_count *
+				    sizeof(struct soc_reg));
+	if (!schema->strings || !schema->tops || !schema->regs)
+		return -EINVAL;
+
+	schema->strings_size = strings->size;
+	schema->phf = NULL;
+	schema->fields = NULL;
+	schema->field_count = 0;
+	schema->top_count = header->top_count;
+	schema->reg_count = header->reg_count;
+
+	/* Every name must be in bounds and NUL terminated */
+	if (schema->strings[schema->strings_size - 1] != '\0' ||
+	    header->name >= schema->strings_size)
+		return -EINVAL;
+
+	for (i = 0; i < schema->top_count; i++) {
+		const struct soc_top *top = &schema->tops[i];
+
+		if (top->name >= schema->strings_size ||
+		    top->first_reg > schema->reg_count ||
+		    top->reg_count > schema->reg_count - top->first_reg)
+			return -EINVAL;
+	}
+
+	for (i = 0; i < schema->reg_count; i++)
+		if (schema->regs[i].name >= schema->strings_size)
+			return -EINVAL;
+
+	schema->name = schema->strings + header->name;
+
+	/* An empty SOC has nothing to look up, index_build handles it */
+	phf = find_section(header, SOC_SECTION_PHF);
+	if (phf && schema->top_count + schema->reg_count) {
+		schema->phf = load_phf(schema, file, size, phf);
+		if (!schema->phf)
+			return -EINVAL;
+	}
+
+	fields = find_section(header, SOC_SECTION_FIELDS);
+	if (fields)
+		return load_fields(schema, file, size, fields);
+
+	return 0;
+}
+
+static uint32_t pool_add(char *pool, size_t *used, const char *name,
+			 size_t max)
+{
+	uint32_t offset = *used;
+	size_t len = strnlen(name, max);
+
+	memcpy(pool + offset, name, len);
+	pool[offset + len] = '\0';
+	*used += len + 1;
+
+	return offset;
+}
+
+/* Convert a version 1 file into the version 2 layout on the heap */
+static int load_v1(struct soc_schema *schema, const void *file, size_t size)
+{
+	const struct soc_header_v1 *header = file;
+	const struct top_v1 *top;
+	struct soc_top *tops;
+	struct soc_reg *regs;
+	uint64_t offset = offsetof(struct soc_header_v1, tops);
+	size_t pool_size = MAX_SOC_NAME + 1, used = 0;
+	uint32_t reg_count = 0, i, j;
+	char *pool;
+
+	if (size < sizeof(*header))
+		return -EINVAL;
+
+	/* First pass: validate the chain and size the tables */
+	for (i = 0; i < header->top_count; i++) {
+		if (offset > size - sizeof(*top))
+			return -EINVAL;
+		top = (const struct top_v1 *)((const char *)file + offset);
+		if (top->reg_count > (size - offset - sizeof(*top)) /
+				     sizeof(struct reg_v1))
+			return -EINVAL;
+		reg_count += top->reg_count;
+		pool_size += MAX_TOP_NAME + 1 +
+			     top->reg_count * (MAX_REG_NAME + 1);
+		offset = top->next_offset;
+	}
+
+	tops = calloc(header->top_count, sizeof(*tops));
+	regs = calloc(reg_count, sizeof(*regs));
+	pool = malloc(pool_size);
+	if ((header->top_count && !tops) || (reg_count && !regs) || !pool) {
+		free(tops);
+		free(regs);
+		free(pool);
+		return -ENOMEM;
+	}
+
+	schema->name = pool + pool_add(pool, &used, header->soc_name,
+				       MAX_SOC_NAME);
+
+	reg_count = 0;
+	top = header->tops;
+	for (i = 0; i < header->top_count; i++) {
+		tops[i].name = pool_add(pool, &used, top->name, MAX_TOP_NAME);
+		tops[i].reg_count = top->reg_count;
+		tops[i].first_reg = reg_count;
+
+		for (j = 0; j < top->reg_count; j++) {
+			struct soc_reg *reg = &regs[reg_count++];
+
+			reg->name = pool_add(pool, &used, top->regs[j].name,
+					     MAX_REG_NAME);
+			reg->addr = top->regs[j].addr;
+			reg->width = top->regs[j].width;
+		}
+		top = (const struct top_v1 *)((const char *)file +
+					      top->next_offset);
+	}
+
+	schema->strings = pool;
+	schema->strings_size = used;
+	schema->tops = tops;
+	schema->top_count = header->top_count;
+	schema->regs = regs;
+	schema->reg_count = reg_count;
+	schema->phf = NULL;
+	schema->fields = NULL;
+	schema->field_count = 0;
+
+	return 0;
+}
+
+int soc_load(struct soc_schema *schema, const void *file, size_t size)
+{
+	const struct soc_header *header = file;
+
+	if (size < 2 * sizeof(uint32_t) || header->magic != SOC_MAGIC)
+		return -EINVAL;
+
+	switch (header->version) {
+	case 1:
+		return load_v1(schema, file, size);
+	case 2:
+		return load_v2(schema, file, size);
+	default:
+		return -EINVAL;
+	}
+}
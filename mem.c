@@ -0,0 +1,353 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "mem.h"
+
+int mem_cache_init(struct mem_cache *cache, int fd, uint32_t windows)
+{
+	uint32_t sets = 1;
+
+	cache->fd = fd;
+	cache->page_size = getpagesize();
+	cache->windows = NULL;
+	cache->size = 0;
+	cache->apertures = NULL;
+	cache->aperture_count = 0;
+	atomic_init(&cache->clock, 0);
+	atomic_init(&cache->hits, 0);
+	atomic_init(&cache->misses, 0);
+	atomic_init(&cache->evictions, 0);
+	pthread_mutex_init(&cache->lock, NULL);
+
+	if (!windows)
+		return 0;
+
+	while (sets * MEM_CACHE_WAYS < windows)
+		sets <<= 1;
+
+	cache->windows = calloc(sets * MEM_CACHE_WAYS,
+				sizeof(*cache->windows));
+	if (!cache->windows)
+		return -ENOMEM;
+
+	cache->sets_mask = sets - 1;
+	cache->size = sets * MEM_CACHE_WAYS;
+
+	return 0;
+}
+
+static int range_cmp(const void *a, const void *b)
+{
+	const struct mem_range *ra = a, *rb = b;
+
+	if (ra->start != rb->start)
+		return ra->start < rb->start ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Place large windows at a virtual address congruent to their physical
+ * address modulo the huge page size, so the kernel is free to back the
+ * aligned part of the window with huge mappings.
+ */
+static void *map_window(struct mem_cache *cache, uint64_t start, size_t size)
+{
+	char *reserve, *base;
+	size_t slack;
+
+	if (size < HUGEPAGE_SIZE)
+		return mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			    cache->fd, start);
+
+	reserve = mmap(NULL, size + HUGEPAGE_SIZE, PROT_NONE,
+		       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (reserve == MAP_FAILED)
+		return MAP_FAILED;
+
+	base = (char *)(((uintptr_t)reserve + HUGEPAGE_SIZE - 1) &
+			~(HUGEPAGE_SIZE - 1)) + (start & (HUGEPAGE_SIZE - 1));
+	if (base + size > reserve + size + HUGEPAGE_SIZE)
+		base -= HUGEPAGE_SIZE;
+
+	if (mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+		 cache->fd, start) == MAP_FAILED) {
+		munmap(reserve, size + HUGEPAGE_SIZE);
+		return MAP_FAILED;
+	}
+
+	if (base > reserve)
+		munmap(reserve, base - reserve);
+	slack = reserve + size + HUGEPAGE_SIZE - (base + size);
+	if (slack)
+		munmap(base + size, slack);
+
+	return base;
+}
+
+/*
+ * Map the given physical ranges once for the lifetime of the mount.
+ * Ranges are page aligned here and merged where they are less than
+ * max_gap bytes apart, so a peripheral block ends up in one window. A
+ * range that can't be mapped is skipped and its registers keep going
+ * through the mapping cache. Returns the number of apertures mapped.
+ */
+int mem_map_apertures(struct mem_cache *cache, struct mem_range *ranges,
+		      uint32_t count, uint64_t max_gap)
+{
+	uint64_t page_mask = cache->page_size - 1;
+	uint32_t i, merged = 0;
+
+	if (!count)
+		return 0;
+
+	for (i = 0; i < count; i++) {
+		ranges[i].start &= ~page_mask;
+		ranges[i].end = (ranges[i].end + page_mask) & ~page_mask;
+	}
+
+	qsort(ranges, count, sizeof(*ranges), range_cmp);
+
+	for (i = 1; i < count; i++) {
+		if (ranges[i].start <= ranges[merged].end + max_gap) {
+			if (ranges[i].end > ranges[merged].end)
+				ranges[merged].end = ranges[i].end;
+		} else {
+			ranges[++merged] = ranges[i];
+		}
+	}
+	count = merged + 1;
+
+	cache->apertures = calloc(count, sizeof(*cache->apertures));
+	if (!cache->apertures)
+		return -ENOMEM;
+
+	for (i = 0; i < count; i++) {
+		struct mem_aperture *aperture;
+		void *base;
+
+		base = map_window(cache, ranges[i].start,
+				  ranges[i].end - ranges[i].start);
+		if (base == MAP_FAILED)
+			continue;
+
+		aperture = &cache->apertures[cache->aperture_count++];
+		aperture->start = ranges[i].start;
+		aperture->end = ranges[i].end;
+		aperture->base = base;
+	}
+
+	return cache->aperture_count;
+}
+
+void *mem_aperture_lookup(struct mem_cache *cache, uint64_t addr,
+			  size_t width)
+{
+	uint32_t lo = 0, hi = cache->aperture_count;
+
+	while (lo < hi) {
+		uint32_t mid = (lo + hi) / 2;
+		struct mem_aperture *aperture = &cache->apertures[mid];
+
+		if (addr < aperture->start) {
+			hi = mid;
+		} else if (addr >= aperture->end) {
+			lo = mid + 1;
+		} else {
+			if (addr + width > aperture->end)
+				return NULL;
+			return aperture->base + (addr - aperture->start);
+		}
+	}
+
+	return NULL;
+}
+
+static int map_uncached(struct mem_cache *cache, uint64_t addr, size_t width,
+			struct mem_ref *ref)
+{
+	uint32_t offset_in_page = addr & (cache->page_size - 1);
+
+	ref->window = NULL;
+	/* Round up to whole pages, an access may span two of them */
+	ref->mapped_size = (offset_in_page + width + cache->page_size - 1) &
+			   ~(size_t)(cache->page_size - 1);
+	ref->map_base = mmap(NULL, ref->mapped_size, PROT_READ | PROT_WRITE,
+			     MAP_SHARED, cache->fd,
+			     addr & ~(uint64_t)(cache->page_size - 1));
+	if (ref->map_base == MAP_FAILED)
+		return -EFAULT;
+
+	ref->virt_addr = (char *)ref->map_base + offset_in_page;
+
+	return 0;
+}
+
+static int aperture_ref(struct mem_cache *cache, uint64_t addr, size_t width,
+			struct mem_ref *ref)
+{
+	if (!cache->aperture_count)
+		return 0;
+
+	ref->virt_addr = mem_aperture_lookup(cache, addr, width);
+	if (!ref->virt_addr)
+		return 0;
+
+	ref->window = NULL;
+	ref->map_base = NULL;
+	return 1;
+}
+
+/* Lock free probe, takes a reference on success */
+static struct mem_window *cache_lookup(struct mem_cache *cache,
+				       struct mem_window *set, uint64_t tag)
+{
+	uint64_t now = atomic_load_explicit(&cache->clock,
+					    memory_order_relaxed);
+	int i;
+
+	for (i = 0; i < MEM_CACHE_WAYS; i++) {
+		struct mem_window *window = &set[i];
+
+		if (atomic_load_explicit(&window->tag,
+					 memory_order_acquire) != tag)
+			continue;
+
+		/* Pairs with the tag clear and refs check in cache_fill() */
+		atomic_fetch_add(&window->refs, 1);
+		if (atomic_load(&window->tag) != tag) {
+			atomic_fetch_sub_explicit(&window->refs, 1,
+						  memory_order_release);
+			return NULL;
+		}
+
+		if (atomic_load_explicit(&window->stamp,
+					 memory_order_relaxed) != now)
+			atomic_store_explicit(&window->stamp, now,
+					      memory_order_relaxed);
+		return window;
+	}
+
+	return NULL;
+}
+
+/*
+ * Fill the least recently used way of the set. Ways with references,
+ * such as those pinned by open register files, are never evicted; when
+ * all of them are, or the victim gains one while being evicted, NULL is
+ * returned and the caller maps on its own.
+ */
+static struct mem_window *cache_fill(struct mem_cache *cache,
+				     struct mem_window *set, uint64_t tag)
+{
+	struct mem_window *victim = NULL;
+	uint64_t page = tag - 1, old_tag;
+	void *base;
+	int i;
+
+	for (i = 0; i < MEM_CACHE_WAYS; i++) {
+		if (!atomic_load(&set[i].tag)) {
+			victim = &set[i];
+			break;
+		}
+		if (atomic_load(&set[i].refs))
+			continue;
+		if (!victim ||
+		    atomic_load(&set[i].stamp) < atomic_load(&victim->stamp))
+			victim = &set[i];
+	}
+	if (!victim)
+		return NULL;
+
+	if (atomic_load(&victim->tag)) {
+		old_tag = atomic_load(&victim->tag);
+		atomic_store(&victim->tag, 0);
+		/*
+		 * A lookup may have taken a reference meanwhile, possibly for
+		 * an open file. Leave the way alone rather than wait for it.
+		 */
+		if (atomic_load(&victim->refs)) {
+			atomic_store(&victim->tag, old_tag);
+			return NULL;
+		}
+		munmap(victim->base, cache->page_size);
+		atomic_fetch_add_explicit(&cache->evictions, 1,
+					  memory_order_relaxed);
+	}
+
+	base = mmap(NULL, cache->page_size, PROT_READ | PROT_WRITE,
+		    MAP_SHARED, cache->fd, page * cache->page_size);
+	if (base == MAP_FAILED)
+		return NULL;
+
+	victim->base = base;
+	atomic_store_explicit(&victim->stamp,
+			      atomic_fetch_add(&cache->clock, 1) + 1,
+			      memory_order_relaxed);
+	atomic_fetch_add_explicit(&victim->refs, 1, memory_order_relaxed);
+	atomic_store_explicit(&victim->tag, tag, memory_order_release);
+
+	return victim;
+}
+
+int mem_get(struct mem_cache *cache, uint64_t addr, size_t width,
+	    struct mem_ref *ref)
+{
+	uint32_t offset_in_page = addr & (cache->page_size - 1);
+	uint64_t page = addr / cache->page_size;
+	struct mem_window *set, *window;
+
+	if (aperture_ref(cache, addr, width, ref))
+		return 0;
+
+	if (!cache->size || offset_in_page + width > cache->page_size)
+		return map_uncached(cache, addr, width, ref);
+
+	set = &cache->windows[(page & cache->sets_mask) * MEM_CACHE_WAYS];
+
+	window = cache_lookup(cache, set, page + 1);
+	if (!window) {
+		pthread_mutex_lock(&cache->lock);
+		/* Someone may have filled it while we waited */
+		window = cache_lookup(cache, set, page + 1);
+		if (!window) {
+			window = cache_fill(cache, set, page + 1);
+			atomic_fetch_add_explicit(&cache->misses, 1,
+						  memory_order_relaxed);
+		}
+		pthread_mutex_unlock(&cache->lock);
+		if (!window)
+			return map_uncached(cache, addr, width, ref);
+	} else {
+		atomic_fetch_add_explicit(&cache->hits, 1,
+					  memory_order_relaxed);
+	}
+
+	ref->window = window;
+	ref->virt_addr = window->base + offset_in_page;
+
+	return 0;
+}
+
+/*
+ * Like mem_get(), but for whole ranges: the mapping is private to the
+ * caller rather than a cache window. width may span any number of
+ * pages.
+ */
+int mem_map(struct mem_cache *cache, uint64_t addr, size_t width,
+	    struct mem_ref *ref)
+{
+	if (aperture_ref(cache, addr, width, ref))
+		return 0;
+
+	return map_uncached(cache, addr, width, ref);
+}
+
+void mem_put(struct mem_cache *cache, struct mem_ref *ref)
+{
+	if (ref->window)
+		atomic_fetch_sub_explicit(&ref->window->refs, 1,
+					  memory_order_release);
+	else if (ref->map_base)
+		munmap(ref->map_base, ref->mapped_size);
+}
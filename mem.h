@@ -0,0 +1,122 @@
+#ifndef MEM_H
+#define MEM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#define MEM_CACHE_WAYS		4
+#define MEM_CACHE_DEFAULT	256
+
+#define HUGEPAGE_SIZE		(2UL << 20)
+#define APERTURE_MAX_GAP	(64UL << 10)
+
+/*
+ * A window maps a single page of /dev/mem. tag holds the physical page
+ * number plus one, so zero means the window is empty or being replaced.
+ * refs counts readers currently dereferencing base; a window is only
+ * unmapped once its tag has been cleared and refs has drained to zero.
+ */
+struct mem_window {
+	_Atomic uint64_t tag;
+	_Atomic uint32_t refs;
+	_Atomic uint64_t stamp;
+	char *base;
+};
+
+/* A physical range, end is exclusive */
+struct mem_range {
+	uint64_t start;
+	uint64_t end;
+};
+
+/* A window of /dev/mem mapped for the lifetime of the mount */
+struct mem_aperture {
+	uint64_t start;
+	uint64_t end;
+	char *base;
+};
+
+/*
+ * Set associative cache of /dev/mem page mappings. Hits are lock free;
+ * misses and evictions are serialized by lock and evict the least
+ * recently used way of the set that nobody holds a reference to. When
+ * every way is held, the page is mapped on its own instead. Accesses
+ * inside one of the apertures mapped at mount time bypass the cache
+ * altogether.
+ */
+struct mem_cache {
+	int fd;
+	uint32_t page_size;
+	uint32_t sets_mask;
+	uint32_t size;
+	struct mem_window *windows;
+	pthread_mutex_t lock;
+	_Atomic uint64_t clock;
+	_Atomic uint64_t hits;
+	_Atomic uint64_t misses;
+	_Atomic uint64_t evictions;
+	struct mem_aperture *apertures;
+	uint32_t aperture_count;
+};
+
+/* A live reference to mapped memory, released with mem_put() */
+struct mem_ref {
+	void *virt_addr;
+	struct mem_window *window;
+	void *map_base;
+	size_t mapped_size;
+};
+
+static inline uint64_t mem_read(const volatile void *addr, unsigned int width)
+{
+	switch (width) {
+	case 1:
+		return *(const volatile uint8_t *)addr;
+	case 2:
+		return *(const volatile uint16_t *)addr;
+	case 4:
+		return *(const volatile uint32_t *)addr;
+	default:
+		return *(const volatile uint64_t *)addr;
+	}
+}
+
+static inline void mem_write(volatile void *addr, unsigned int width,
+			     uint64_t value)
+{
+	switch (width) {
+	case 1:
+		*(volatile uint8_t *)addr = value;
+		break;
+	case 2:
+		*(volatile uint16_t *)addr = value;
+		break;
+	case 4:
+		*(volatile uint32_t *)addr = value;
+		break;
+	default:
+		*(volatile uint64_t *)addr = value;
+		break;
+	}
+}
+
+/* Order every access issued before it against every one after */
+static inline void mem_barrier(void)
+{
+	atomic_thread_fence(memory_order_seq_cst);
+}
+
+int mem_cache_init(struct mem_cache *cache, int fd, uint32_t windows);
+int mem_map_apertures(struct mem_cache *cache, struct mem_range *ranges,
+		      uint32_t count, uint64_t max_gap);
+void *mem_aperture_lookup(struct mem_cache *cache, uint64_t addr,
+			  size_t width);
+int mem_get(struct mem_cache *cache, uint64_t addr, size_t width,
+	    struct mem_ref *ref);
+int mem_map(struct mem_cache *cache, uint64_t addr, size_t width,
+	    struct mem_ref *ref);
+void mem_put(struct mem_cache *cache, struct mem_ref *ref);
+
+#endif /* MEM_H */
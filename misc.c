@@ -1,5 +1,7 @@
 #include <stdio.h>
 #include <ctype.h>
+#include <errno.h>
+#include <string.h>
 #include <inttypes.h>
 #include "misc.h"
 
@@ -77,3 +79,69 @@ int parse_input(const char *input, uint64_t *val)
 	return base_scanf(input, base, val);
 }
 
+
+/* Trim leading and trailing white space in place */
+char *strip(char *s)
+{
+	char *end;
+
+	while (isspace((unsigned char)*s))
+		s++;
+	end = s + strlen(s);
+	while (end > s && isspace((unsigned char)end[-1]))
+		end--;
+	*end = '\0';
+
+	return s;
+}
+
+/* Hand the buffered start of a line, completed by size bytes, to fn */
+static int line_buf_emit(struct line_buf *lb, const char *buf, size_t size,
+			 line_fn_t fn, void *ctx)
+{
+	char line[LINE_BUF_MAX];
+	int overflow = lb->overflow || lb->len + size >= LINE_BUF_MAX;
+
+	if (!overflow) {
+		memcpy(line, lb->data, lb->len);
+		memcpy(line + lb->len, buf, size);
+		line[lb->len + size] = '\0';
+	}
+
+	lb->len = 0;
+	lb->overflow = 0;
+
+	return fn(ctx, overflow ? NULL : line, overflow ? -E2BIG : 0);
+}
+
+/* Calls fn for every complete line, stopping at the first error it returns */
+int line_buf_split(struct line_buf *lb, const char *buf, size_t size,
+		   line_fn_t fn, void *ctx)
+{
+	const char *pos, *end = buf + size, *nl;
+	int ret;
+
+	for (pos = buf; (nl = memchr(pos, '\n', end - pos)); pos = nl + 1) {
+		ret = line_buf_emit(lb, pos, nl - pos, fn, ctx);
+		if (ret)
+			return ret;
+	}
+
+	if (!lb->overflow && lb->len + (end - pos) < LINE_BUF_MAX) {
+		memcpy(lb->data + lb->len, pos, end - pos);
+		lb->len += end - pos;
+	} else {
+		lb->overflow = 1;
+	}
+
+	return 0;
+}
+
+/* Calls fn for a last line that wasn't terminated by a newline */
+int line_buf_finish(struct line_buf *lb, line_fn_t fn, void *ctx)
+{
+	if (!lb->len && !lb->overflow)
+		return 0;
+
+	return line_buf_emit(lb, "", 0, fn, ctx);
+}
@@ -1,4 +1,29 @@
+#ifndef MISC_H
+#define MISC_H
+
 #include <stdint.h>
+#include <stddef.h>
 
 int parse_input(const char *input, uint64_t *val);
 
+/*
+ * Splits the data written to a control file into lines. A line split
+ * across writes is kept in data until its end arrives; a line longer
+ * than LINE_BUF_MAX is reported with -E2BIG instead of its text.
+ */
+#define LINE_BUF_MAX	512
+
+struct line_buf {
+	size_t len;
+	int overflow;
+	char data[LINE_BUF_MAX];
+};
+
+typedef int (*line_fn_t)(void *ctx, char *line, int err);
+
+int line_buf_split(struct line_buf *lb, const char *buf, size_t size,
+		   line_fn_t fn, void *ctx);
+int line_buf_finish(struct line_buf *lb, line_fn_t fn, void *ctx);
+char *strip(char *s);
+
+#endif /* MISC_H */
@@ -0,0 +1,982 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "misc.h"
+#include "node.h"
+#include "socfs_ioctl.h"
+
+/* Special files living in the root directory, after the root itself */
+#define SPECIAL_FIRST	2
+
+/*
+ * show formats the whole content into buf, returning its length. Files
+ * with a size callback have fixed size binary content: it is captured
+ * once at open and served through the page cache, so it can be mmapped.
+ * show_size, when set, gives the text buffer show needs next time.
+ * Control files keep per open state in the handle's priv, set up by
+ * open and torn down by release. Writes to posted files may be queued
+ * with --writeback, those to other files see all queued writes applied.
+ */
+struct special_file {
+	const char *name;
+	mode_t mode;
+	int (*show)(struct soc_private *private, struct node_handle *handle,
+		    char *buf, size_t size);
+	size_t (*size)(struct soc_private *private);
+	size_t (*show_size)(struct soc_private *private,
+			    struct node_handle *handle);
+	int (*open)(struct soc_private *private, struct node_handle *handle);
+	int (*write)(struct soc_private *private, struct node_handle *handle,
+		     const char *buf, size_t size);
+	int (*flush)(struct soc_private *private, struct node_handle *handle);
+	void (*release)(struct soc_private *private,
+			struct node_handle *handle);
+	int posted;
+};
+
+static int show_stats(struct soc_private *private, struct node_handle *handle,
+		      char *buf, size_t size)
+{
+	struct mem_cache *mem = &private->mem;
+
+	return snprintf(buf, size,
+		       "map_cache_size: %u\n"
+		       "map_cache_hits: %" PRIu64 "\n"
+		       "map_cache_misses: %" PRIu64 "\n"
+		       "map_cache_evictions: %" PRIu64 "\n"
+		       "reg_cache_hits: %" PRIu64 "\n"
+		       "reg_cache_misses: %" PRIu64 "\n"
+		       "reg_coalesced_reads: %" PRIu64 "\n"
+		       "reg_stale_hits: %" PRIu64 "\n"
+		       "reg_sweeps: %" PRIu64 "\n",
+		       mem->size, atomic_load(&mem->hits),
+		       atomic_load(&mem->misses),
+		       atomic_load(&mem->evictions),
+		       atomic_load(&private->regs.cache_hits),
+		       atomic_load(&private->regs.cache_misses),
+		       atomic_load(&private->regs.coalesced),
+		       atomic_load(&private->regs.stale_hits),
+		       atomic_load(&private->regs.sweep_count));
+}
+
+/* Every counter printed in full, beyond NODE_SNAPSHOT_SIZE */
+static size_t show_size_stats(struct soc_private *private,
+			      struct node_handle *handle)
+{
+	return 512;
+}
+
+/* Write only control files */
+static int show_none(struct soc_private *private, struct node_handle *handle,
+		     char *buf, size_t size)
+{
+	return -EACCES;
+}
+
+static int show_snapshot(struct soc_private *private,
+			 struct node_handle *handle, char *buf, size_t size)
+{
+	return snapshot_capture(private, buf, size);
+}
+
+static size_t size_snapshot(struct soc_private *private)
+{
+	return snapshot_size(&private->schema);
+}
+
+static int open_batch(struct soc_private *private, struct node_handle *handle)
+{
+	handle->priv = batch_new();
+
+	return handle->priv ? 0 : -ENOMEM;
+}
+
+static size_t show_size_batch(struct soc_private *private,
+			      struct node_handle *handle)
+{
+	return BATCH_SHOW_SIZE;
+}
+
+static int show_batch(struct soc_private *private, struct node_handle *handle,
+		      char *buf, size_t size)
+{
+	return batch_show(handle->priv, buf, size);
+}
+
+static int write_batch(struct soc_private *private, struct node_handle *handle,
+		       const char *buf, size_t size)
+{
+	return batch_write(private, handle->priv, buf, size);
+}
+
+static int flush_batch(struct soc_private *private, struct node_handle *handle)
+{
+	return batch_flush(private, handle->priv);
+}
+
+static void release_batch(struct soc_private *private,
+			  struct node_handle *handle)
+{
+	batch_free(handle->priv);
+}
+
+static int open_query(struct soc_private *private, struct node_handle *handle)
+{
+	handle->priv = query_new();
+
+	return handle->priv ? 0 : -ENOMEM;
+}
+
+static size_t show_size_query(struct soc_private *private,
+			      struct node_handle *handle)
+{
+	return query_show_size(handle->priv);
+}
+
+static int show_query(struct soc_private *private, struct node_handle *handle,
+		      char *buf, size_t size)
+{
+	return query_show(private, handle->priv, buf, size);
+}
+
+static int write_query(struct soc_private *private, struct node_handle *handle,
+		       const char *buf, size_t size)
+{
+	return query_write(private, handle->priv, buf, size);
+}
+
+static int flush_query(struct soc_private *private, struct node_handle *handle)
+{
+	return query_flush(private, handle->priv);
+}
+
+static void release_query(struct soc_private *private,
+			  struct node_handle *handle)
+{
+	query_free(private, handle->priv);
+}
+
+static int open_wait(struct soc_private *private, struct node_handle *handle)
+{
+	handle->priv = waiter_new();
+
+	return handle->priv ? 0 : -ENOMEM;
+}
+
+static int show_wait(struct soc_private *private, struct node_handle *handle,
+		     char *buf, size_t size)
+{
+	return waiter_show(handle->priv, buf, size);
+}
+
+static int write_wait(struct soc_private *private, struct node_handle *handle,
+		      const char *buf, size_t size)
+{
+	return waiter_write(private, handle->priv, buf, size);
+}
+
+static void release_wait(struct soc_private *private,
+			 struct node_handle *handle)
+{
+	waiter_free(handle->priv);
+}
+
+static int open_invalidate(struct soc_private *private,
+			   struct node_handle *handle)
+{
+	handle->priv = invalidate_new();
+
+	return handle->priv ? 0 : -ENOMEM;
+}
+
+static int write_invalidate(struct soc_private *private,
+			    struct node_handle *handle, const char *buf,
+			    size_t size)
+{
+	return invalidate_write(private, handle->priv, buf, size);
+}
+
+static int flush_invalidate(struct soc_private *private,
+			    struct node_handle *handle)
+{
+	return invalidate_flush(private, handle->priv);
+}
+
+static void release_invalidate(struct soc_private *private,
+			       struct node_handle *handle)
+{
+	invalidate_free(handle->priv);
+}
+
+static const struct special_file specials[] = {
+	{
+		.name = ".stats",
+		.mode = 0444,
+		.show = show_stats,
+		.show_size = show_size_stats,
+	}, {
+		.name = ".snapshot",
+		.mode = 0444,
+		.show = show_snapshot,
+		.size = size_snapshot,
+	}, {
+		.name = ".batch",
+		.mode = 0666,
+		.show = show_batch,
+		.show_size = show_size_batch,
+		.open = open_batch,
+		.write = write_batch,
+		.flush = flush_batch,
+		.release = release_batch,
+		.posted = 1,
+	}, {
+		.name = ".query",
+		.mode = 0666,
+		.show = show_query,
+		.show_size = show_size_query,
+		.open = open_query,
+		.write = write_query,
+		.flush = flush_query,
+		.release = release_query,
+	}, {
+		.name = ".wait",
+		.mode = 0666,
+		.show = show_wait,
+		.open = open_wait,
+		.write = write_wait,
+		.release = release_wait,
+	}, {
+		.name = ".invalidate",
+		.mode = 0222,
+		.show = show_none,
+		.open = open_invalidate,
+		.write = write_invalidate,
+		.flush = flush_invalidate,
+		.release = release_invalidate,
+	},
+};
+
+#define SPECIAL_COUNT (sizeof(specials) / sizeof(specials[0]))
+
+static const struct special_file *node_special(uint64_t node)
+{
+	uint64_t index = NODE_INDEX(node);
+
+	if (NODE_KIND(node) != NODE_KIND_SPECIAL || index < SPECIAL_FIRST ||
+	    index >= SPECIAL_FIRST + SPECIAL_COUNT)
+		return NULL;
+
+	return &specials[index - SPECIAL_FIRST];
+}
+
+/* Returns the top id of a dump node, or -1 */
+static int node_dump(struct soc_private *private, uint64_t node)
+{
+	if (NODE_KIND(node) != NODE_KIND_DUMP ||
+	    NODE_INDEX(node) >= private->schema.top_count)
+		return -1;
+
+	return NODE_INDEX(node);
+}
+
+/* Returns the register id of a register file or value node, or -1 */
+static int node_reg(struct soc_private *private, uint64_t node)
+{
+	uint64_t index = NODE_INDEX(node);
+
+	if (index >= private->schema.reg_count)
+		return -1;
+	if (NODE_KIND(node) == NODE_KIND_VALUE ||
+	    (NODE_KIND(node) == NODE_KIND_REG &&
+	     !reg_field_count(&private->regs, index)))
+		return index;
+
+	return -1;
+}
+
+/* Returns the register id of a register directory, or -1 */
+static int node_reg_dir(struct soc_private *private, uint64_t node)
+{
+	uint64_t index = NODE_INDEX(node);
+
+	if (NODE_KIND(node) != NODE_KIND_REG ||
+	    index >= private->schema.reg_count ||
+	    !reg_field_count(&private->regs, index))
+		return -1;
+
+	return index;
+}
+
+/* Returns the field id of a field node, or -1 */
+static int node_field(struct soc_private *private, uint64_t node)
+{
+	if (NODE_KIND(node) != NODE_KIND_FIELD ||
+	    NODE_INDEX(node) >= private->schema.field_count)
+		return -1;
+
+	return NODE_INDEX(node);
+}
+
+/*
+ * Writing a mask to a register's bit siblings sets, clears or toggles
+ * those bits with a single read-modify-write in the daemon.
+ */
+static const struct {
+	const char *suffix;
+	enum node_kind kind;
+} bit_siblings[] = {
+	{ ".set", NODE_KIND_SET },
+	{ ".clr", NODE_KIND_CLEAR },
+	{ ".tgl", NODE_KIND_TOGGLE },
+};
+
+#define BIT_SIBLING_COUNT (sizeof(bit_siblings) / sizeof(bit_siblings[0]))
+
+/* Returns the register id of a bit sibling, or -1 */
+static int node_bits(struct soc_private *private, uint64_t node)
+{
+	if ((NODE_KIND(node) != NODE_KIND_SET &&
+	     NODE_KIND(node) != NODE_KIND_CLEAR &&
+	     NODE_KIND(node) != NODE_KIND_TOGGLE) ||
+	    NODE_INDEX(node) >= private->schema.reg_count)
+		return -1;
+
+	return NODE_INDEX(node);
+}
+
+/* Look up "<reg><suffix>" among the registers of a top */
+static int lookup_bits(struct soc_private *private, uint32_t top,
+		       const char *name, uint64_t *node)
+{
+	size_t len = strlen(name), suffix;
+	char reg_name[NAME_MAX + 1];
+	int i, reg;
+
+	for (i = 0; i < BIT_SIBLING_COUNT; i++) {
+		suffix = strlen(bit_siblings[i].suffix);
+		if (len <= suffix || len - suffix > NAME_MAX ||
+		    strcmp(name + len - suffix, bit_siblings[i].suffix))
+			continue;
+
+		memcpy(reg_name, name, len - suffix);
+		reg_name[len - suffix] = '\0';
+		reg = index_find_child(&private->index, &private->schema, top,
+				       reg_name);
+		if (reg < 0)
+			return -ENOENT;
+
+		*node = NODE(bit_siblings[i].kind, reg);
+		return 0;
+	}
+
+	return -ENOENT;
+}
+
+/* Returns the register accessed by a file, or -1 */
+static int node_file_reg(struct soc_private *private, uint64_t node)
+{
+	int field = node_field(private, node);
+
+	if (field >= 0)
+		return private->schema.fields[field].reg;
+	if (node_bits(private, node) >= 0)
+		return NODE_INDEX(node);
+
+	return node_reg(private, node);
+}
+
+int node_is_dir(struct soc_private *private, uint64_t node)
+{
+	return node == NODE_ROOT ||
+	       (NODE_KIND(node) == NODE_KIND_TOP &&
+		NODE_INDEX(node) < private->schema.top_count) ||
+	       node_reg_dir(private, node) >= 0;
+}
+
+int node_lookup(struct soc_private *private, uint64_t parent,
+		const char *name, uint64_t *node)
+{
+	struct soc_schema *schema = &private->schema;
+	struct reg_table *regs = &private->regs;
+	int i, reg;
+
+	if (parent == NODE_ROOT) {
+		for (i = 0; i < SPECIAL_COUNT; i++)
+			if (!strcmp(name, specials[i].name)) {
+				*node = NODE(NODE_KIND_SPECIAL,
+					     SPECIAL_FIRST + i);
+				return 0;
+			}
+
+		i = index_find_top(&private->index, schema, name,
+				   strlen(name));
+		if (i < 0)
+			return -ENOENT;
+
+		*node = NODE(NODE_KIND_TOP, i);
+		return 0;
+	}
+
+	if (NODE_KIND(parent) == NODE_KIND_TOP &&
+	    NODE_INDEX(parent) < schema->top_count) {
+		if (!strcmp(name, DUMP_NAME)) {
+			*node = NODE(NODE_KIND_DUMP, NODE_INDEX(parent));
+			return 0;
+		}
+
+		i = index_find_child(&private->index, schema,
+				     NODE_INDEX(parent), name);
+		if (i < 0)
+			return lookup_bits(private, NODE_INDEX(parent), name,
+					   node);
+
+		*node = NODE(NODE_KIND_REG, i);
+		return 0;
+	}
+
+	reg = node_reg_dir(private, parent);
+	if (reg >= 0) {
+		if (!strcmp(name, VALUE_NAME)) {
+			*node = NODE(NODE_KIND_VALUE, reg);
+			return 0;
+		}
+
+		/* Registers only have a handful of fields */
+		for (i = regs->first_field[reg];
+		     i < regs->first_field[reg + 1]; i++)
+			if (!strcmp(name, field_name(schema, i))) {
+				*node = NODE(NODE_KIND_FIELD, i);
+				return 0;
+			}
+	}
+
+	return -ENOENT;
+}
+
+/* Write-only registers read back their shadow */
+static mode_t reg_mode(struct soc_private *private, uint32_t reg)
+{
+	uint8_t flags = private->regs.flags[reg];
+	mode_t mode = 0;
+
+	if (flags & (REG_READABLE | REG_WRITABLE))
+		mode |= 0444;
+	if (flags & REG_WRITABLE)
+		mode |= 0222;
+
+	return mode;
+}
+
+int node_getattr(struct soc_private *private, uint64_t node,
+		 struct stat *stbuf)
+{
+	const struct special_file *special;
+	int field, reg;
+
+	memset(stbuf, 0, sizeof(struct stat));
+	stbuf->st_ino = node;
+
+	if (node_is_dir(private, node)) {
+		stbuf->st_mode = S_IFDIR | 0755;
+		stbuf->st_nlink = 2;
+		return 0;
+	}
+
+	special = node_special(node);
+	if (special) {
+		stbuf->st_mode = S_IFREG | special->mode;
+		stbuf->st_nlink = 1;
+		if (special->size)
+			stbuf->st_size = special->size(private);
+		return 0;
+	}
+
+	if (node_dump(private, node) >= 0) {
+		stbuf->st_mode = S_IFREG | 0444;
+		stbuf->st_nlink = 1;
+		return 0;
+	}
+
+	reg = node_reg(private, node);
+	if (reg >= 0) {
+		stbuf->st_mode = S_IFREG | reg_mode(private, reg);
+		stbuf->st_nlink = 1;
+		return 0;
+	}
+
+	field = node_field(private, node);
+	if (field >= 0) {
+		stbuf->st_mode = S_IFREG;
+		if (private->schema.fields[field].access & SOC_FIELD_READ)
+			stbuf->st_mode |= 0444;
+		if (private->schema.fields[field].access & SOC_FIELD_WRITE)
+			stbuf->st_mode |= 0222;
+		stbuf->st_mode &= S_IFREG |
+			reg_mode(private, private->schema.fields[field].reg);
+		stbuf->st_nlink = 1;
+		return 0;
+	}
+
+	reg = node_bits(private, node);
+	if (reg >= 0) {
+		stbuf->st_mode = S_IFREG | (reg_mode(private, reg) & 0222);
+		stbuf->st_nlink = 1;
+		return 0;
+	}
+
+	return -ENOENT;
+}
+
+/*
+ * Directory offsets are entry positions: "." and ".." come first, then
+ * the special files of the root, the dump file of a top or the value
+ * file of a register, then the tops, registers or fields.
+ */
+int node_readdir(struct soc_private *private, uint64_t node, off_t offset,
+		 node_fill_t fill, void *ctx)
+{
+	struct soc_schema *schema = &private->schema;
+	uint32_t first = 0, count, i, skip = 2;
+	enum node_kind kind;
+	int reg = node_reg_dir(private, node);
+
+	if (node == NODE_ROOT) {
+		skip += SPECIAL_COUNT;
+		kind = NODE_KIND_TOP;
+		count = schema->top_count;
+	} else if (NODE_KIND(node) == NODE_KIND_TOP &&
+		   NODE_INDEX(node) < schema->top_count) {
+		skip += 1;
+		kind = NODE_KIND_REG;
+		first = schema->tops[NODE_INDEX(node)].first_reg;
+		count = schema->tops[NODE_INDEX(node)].reg_count;
+	} else if (reg >= 0) {
+		skip += 1;
+		kind = NODE_KIND_FIELD;
+		first = private->regs.first_field[reg];
+		count = reg_field_count(&private->regs, reg);
+	} else {
+		return -ENOTDIR;
+	}
+
+	if (offset == 0 && fill(ctx, ".", node, 1))
+		return 0;
+	if (offset <= 1 && fill(ctx, "..", NODE_ROOT, 2))
+		return 0;
+
+	if (node == NODE_ROOT) {
+		for (i = offset > 2 ? offset - 2 : 0; i < SPECIAL_COUNT; i++)
+			if (fill(ctx, specials[i].name,
+				 NODE(NODE_KIND_SPECIAL, SPECIAL_FIRST + i),
+				 i + 3))
+				return 0;
+	} else if (offset <= 2 && reg >= 0) {
+		if (fill(ctx, VALUE_NAME, NODE(NODE_KIND_VALUE, reg), 3))
+			return 0;
+	} else if (offset <= 2 &&
+		   fill(ctx, DUMP_NAME,
+			NODE(NODE_KIND_DUMP, NODE_INDEX(node)), 3)) {
+		return 0;
+	}
+
+	for (i = offset > skip ? offset - skip : 0; i < count; i++) {
+		const char *name = kind == NODE_KIND_TOP ?
+				   top_name(schema, i) :
+				   kind == NODE_KIND_REG ?
+				   reg_name(schema, first + i) :
+				   field_name(schema, first + i);
+
+		if (fill(ctx, name, NODE(kind, first + i), skip + i + 1))
+			return 0;
+	}
+
+	return 0;
+}
+
+/*
+ * Read a register or field file's register, within the staleness
+ * budget. Write-only registers are never read, source gets " (shadow)"
+ * when the value is the last one written instead.
+ */
+static int node_reg_read(struct soc_private *private,
+			 struct node_handle *handle, uint64_t *value,
+			 const char **source)
+{
+	*source = "";
+	if (!(handle->reg.flags & REG_READABLE)) {
+		*source = " (shadow)";
+		return reg_handle_shadow(&handle->reg, value);
+	}
+
+	if (!reg_read_stale(private, handle->reg.reg, value))
+		return 0;
+
+	return reg_handle_read(&handle->reg, value);
+}
+
+/* Sample the file's content into the handle's snapshot */
+static int node_sample(struct soc_private *private,
+		       struct node_handle *handle)
+{
+	const struct special_file *special;
+	const struct soc_field *field = NULL;
+	const char *source;
+	uint64_t result;
+	size_t size;
+	char *data;
+	int top, len, ret;
+
+	/* Reads see every write queued before them */
+	writeback_drain(private);
+
+	special = node_special(handle->node);
+	top = node_dump(private, handle->node);
+	if (node_field(private, handle->node) >= 0)
+		field = &private->schema.fields[NODE_INDEX(handle->node)];
+
+	if (special && special->show_size) {
+		size = special->show_size(private, handle);
+		if (size > handle->snapshot_size) {
+			data = realloc(handle->snapshot, size);
+			if (!data)
+				return -ENOMEM;
+			handle->snapshot = data;
+			handle->snapshot_size = size;
+		}
+	}
+
+	if (special) {
+		len = special->show(private, handle, handle->snapshot,
+				    handle->snapshot_size);
+	} else if (top >= 0) {
+		len = dump_top(private, top, private->dump_json,
+			       handle->snapshot, handle->snapshot_size);
+	} else if (node_bits(private, handle->node) >= 0) {
+		return -EACCES;
+	} else if (field) {
+		if (!(field->access & SOC_FIELD_READ))
+			return -EACCES;
+		ret = node_reg_read(private, handle, &result, &source);
+		if (ret)
+			return ret;
+
+		len = snprintf(handle->snapshot, handle->snapshot_size,
+			       "0x%" PRIx64 "%s\n",
+			       (result & field_mask(field)) >> field->lsb,
+			       source);
+	} else {
+		ret = node_reg_read(private, handle, &result, &source);
+		if (ret)
+			return ret;
+
+		len = snprintf(handle->snapshot, handle->snapshot_size,
+			       "0x%" PRIx64 " -> 0x%" PRIx64 "%s\n",
+			       private->regs.addr[handle->reg.reg], result,
+			       source);
+		if (handle->watched)
+			watch_seen(private, handle);
+	}
+
+	if (len < 0)
+		return len;
+	if (len >= handle->snapshot_size && !(special && special->size))
+		len = handle->snapshot_size - 1;
+	handle->snapshot_len = len;
+	handle->snapshot_valid = 1;
+
+	return 0;
+}
+
+int node_open(struct soc_private *private, uint64_t node, int flags,
+	      struct node_handle **handle)
+{
+	const struct special_file *special;
+	size_t size = NODE_SNAPSHOT_SIZE;
+	struct node_handle *h;
+	int reg, top, ret;
+
+	reg = node_file_reg(private, node);
+	top = node_dump(private, node);
+	special = node_special(node);
+	if (reg < 0 && top < 0 && !special)
+		return -EISDIR;
+
+	/* Refuse writers of read-only registers before mapping anything */
+	if (reg >= 0 && (flags & O_ACCMODE) != O_RDONLY &&
+	    !(private->regs.flags[reg] & REG_WRITABLE))
+		return -EACCES;
+
+	if (top >= 0)
+		size = dump_size(&private->schema, top);
+	else if (special && special->size)
+		size = special->size(private);
+
+	h = calloc(1, sizeof(*h));
+	if (!h)
+		return -ENOMEM;
+	h->snapshot = malloc(size);
+	if (!h->snapshot) {
+		free(h);
+		return -ENOMEM;
+	}
+	h->node = node;
+	h->snapshot_size = size;
+	h->direct_io = 1;
+	pthread_mutex_init(&h->lock, NULL);
+
+	if (special && special->open) {
+		ret = special->open(private, h);
+		if (ret) {
+			free(h->snapshot);
+			free(h);
+			return ret;
+		}
+	}
+
+	if (special && special->size) {
+		ret = node_sample(private, h);
+		if (ret) {
+			node_release(private, h);
+			return ret;
+		}
+		h->direct_io = 0;
+	}
+
+	if (reg >= 0) {
+		ret = reg_open(private, reg, &h->reg);
+		if (ret) {
+			free(h->snapshot);
+			free(h);
+			return ret;
+		}
+	}
+
+	*handle = h;
+	return 0;
+}
+
+/* Closing a file that queued writes waits for them to land */
+int node_flush(struct soc_private *private, struct node_handle *handle)
+{
+	const struct special_file *special = node_special(handle->node);
+	int ret = 0, err;
+
+	pthread_mutex_lock(&handle->lock);
+	if (special && special->flush)
+		ret = special->flush(private, handle);
+
+	if (handle->posted) {
+		handle->posted = 0;
+		err = writeback_sync(private);
+		if (!ret)
+			ret = err;
+	}
+	pthread_mutex_unlock(&handle->lock);
+
+	return ret;
+}
+
+int node_fsync(struct soc_private *private, struct node_handle *handle)
+{
+	pthread_mutex_lock(&handle->lock);
+	handle->posted = 0;
+	pthread_mutex_unlock(&handle->lock);
+
+	return writeback_sync(private);
+}
+
+void node_release(struct soc_private *private, struct node_handle *handle)
+{
+	const struct special_file *special = node_special(handle->node);
+
+	if (special && special->release)
+		special->release(private, handle);
+	if (handle->watched)
+		watch_release(private, handle);
+	if (node_file_reg(private, handle->node) >= 0)
+		reg_close(private, &handle->reg);
+	pthread_mutex_destroy(&handle->lock);
+	free(handle->snapshot);
+	free(handle);
+}
+
+/*
+ * A read at offset 0 samples the hardware once, reads further into the
+ * file are served from that snapshot. A read that is split into several
+ * requests therefore sees a single consistent value. The snapshot is
+ * copied to buf before another request on the handle can refill it.
+ */
+int node_read(struct soc_private *private, struct node_handle *handle,
+	      char *buf, size_t size, off_t offset)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&handle->lock);
+
+	/* Captured once at open, see struct special_file */
+	if ((offset == 0 && handle->direct_io) || !handle->snapshot_valid)
+		ret = node_sample(private, handle);
+
+	if (!ret && offset < handle->snapshot_len) {
+		if (size > handle->snapshot_len - offset)
+			size = handle->snapshot_len - offset;
+		memcpy(buf, handle->snapshot + offset, size);
+		ret = size;
+	}
+
+	pthread_mutex_unlock(&handle->lock);
+
+	return ret;
+}
+
+/* A field is written as a masked read-modify-write of its register */
+static int node_write_field(struct soc_private *private,
+			    struct node_handle *handle, uint64_t value)
+{
+	const struct soc_field *field;
+
+	field = &private->schema.fields[NODE_INDEX(handle->node)];
+	if (!(field->access & SOC_FIELD_WRITE))
+		return -EACCES;
+	if (value > field_mask(field) >> field->lsb)
+		return -ERANGE;
+
+	/* Ones written to a write 1 to clear field clear its bits */
+	if (handle->reg.flags & REG_W1C)
+		return reg_handle_write(&handle->reg, value << field->lsb);
+
+	return reg_handle_update(&handle->reg, field_mask(field),
+				 value << field->lsb, NULL);
+}
+
+static int node_write_bits(struct soc_private *private,
+			   struct node_handle *handle, uint64_t mask)
+{
+	switch (NODE_KIND(handle->node)) {
+	case NODE_KIND_SET:
+		return reg_handle_update(&handle->reg, mask, mask, NULL);
+	case NODE_KIND_CLEAR:
+		return reg_handle_update(&handle->reg, mask, 0, NULL);
+	default:
+		return reg_handle_toggle(&handle->reg, mask);
+	}
+}
+
+static int node_write_locked(struct soc_private *private,
+			     struct node_handle *handle, const char *buf,
+			     size_t size)
+{
+	const struct special_file *special = node_special(handle->node);
+	uint64_t writeval;
+	char input[64];
+	int ret;
+
+	if (special && special->write) {
+		if (special->posted)
+			handle->posted = 1;
+		else
+			writeback_drain(private);
+		return special->write(private, handle, buf, size);
+	}
+	if (node_file_reg(private, handle->node) < 0 ||
+	    !(handle->reg.flags & REG_WRITABLE))
+		return -EACCES;
+
+	/* The request buffer isn't NUL terminated */
+	if (size >= sizeof(input))
+		return -EINVAL;
+	memcpy(input, buf, size);
+	input[size] = '\0';
+
+	if (parse_input(input, &writeval))
+		return -EINVAL;
+
+	if (private->writeback && node_reg(private, handle->node) >= 0) {
+		ret = writeback_write(private, handle->reg.reg, writeval);
+		handle->posted = 1;
+	} else {
+		writeback_drain(private);
+		if (node_field(private, handle->node) >= 0)
+			ret = node_write_field(private, handle, writeval);
+		else if (node_bits(private, handle->node) >= 0)
+			ret = node_write_bits(private, handle, writeval);
+		else
+			ret = reg_handle_write(&handle->reg, writeval);
+	}
+	if (ret)
+		return ret;
+
+	handle->snapshot_valid = 0;
+
+	return size;
+}
+
+int node_write(struct soc_private *private, struct node_handle *handle,
+	       const char *buf, size_t size, off_t offset)
+{
+	int ret;
+
+	pthread_mutex_lock(&handle->lock);
+	ret = node_write_locked(private, handle, buf, size);
+	pthread_mutex_unlock(&handle->lock);
+
+	return ret;
+}
+
+/*
+ * Register files are readable once their value changed since the last
+ * read of the file, as seen by the sampler thread. Other files, and
+ * write-only or read-clear registers the sampler mustn't read, are
+ * always readable. ph is consumed in any case.
+ */
+int node_poll(struct soc_private *private, struct node_handle *handle,
+	      void *ph, unsigned int *revents)
+{
+	int ret;
+
+	if (node_reg(private, handle->node) < 0 ||
+	    !(handle->reg.flags & REG_READABLE) ||
+	    (handle->reg.flags & REG_READ_CLEAR)) {
+		watch_drop(private, ph);
+		*revents = POLLIN | POLLRDNORM;
+		return 0;
+	}
+
+	ret = watch_poll(private, handle, ph);
+	if (ret < 0)
+		return ret;
+
+	*revents = ret ? POLLIN | POLLRDNORM : 0;
+	return 0;
+}
+
+/*
+ * Binary register access, see socfs_ioctl.h. handle is only used for
+ * register files, and may be NULL for the root directory.
+ */
+int node_ioctl(struct soc_private *private, uint64_t node,
+	       struct node_handle *handle, unsigned int cmd, void *data)
+{
+	int ret;
+
+	if (cmd != SOCFS_IOC_OPS)
+		return -ENOTTY;
+
+	writeback_drain(private);
+	if (node == NODE_ROOT)
+		return reg_ops(private, NULL, data);
+	if (node_reg(private, node) < 0)
+		return -ENOTTY;
+
+	ret = reg_ops(private, &handle->reg, data);
+	pthread_mutex_lock(&handle->lock);
+	handle->snapshot_valid = 0;
+	pthread_mutex_unlock(&handle->lock);
+
+	return ret;
+}
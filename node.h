@@ -0,0 +1,156 @@
+#ifndef NODE_H
+#define NODE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "soc.h"
+
+/*
+ * Every entry in the file system is a node with a stable number, which
+ * the low level frontend uses as its inode number. The top byte holds
+ * the kind of node and the rest its index: the top or register id, or
+ * the slot of a special file. The root is special slot 1, which makes
+ * it FUSE_ROOT_ID. Every top also holds a DUMP_NAME file, the dump node
+ * of the same index. A register with bit fields is a directory instead
+ * of a file, holding a file per field and the register's own value as
+ * VALUE_NAME, the value node of the same index. Every register also has
+ * "<reg>.set", "<reg>.clr" and "<reg>.tgl" siblings, which can be looked
+ * up but aren't listed.
+ */
+#define NODE_KIND_SHIFT		56
+#define NODE(kind, index)	(((uint64_t)(kind) << NODE_KIND_SHIFT) | \
+				 (index))
+#define NODE_KIND(node)		((node) >> NODE_KIND_SHIFT)
+#define NODE_INDEX(node)	((node) & ((1ULL << NODE_KIND_SHIFT) - 1))
+
+enum node_kind {
+	NODE_KIND_SPECIAL,
+	NODE_KIND_TOP,
+	NODE_KIND_REG,
+	NODE_KIND_DUMP,
+	NODE_KIND_FIELD,
+	NODE_KIND_VALUE,
+	NODE_KIND_SET,
+	NODE_KIND_CLEAR,
+	NODE_KIND_TOGGLE,
+};
+
+#define DUMP_NAME		".all"
+#define VALUE_NAME		".value"
+
+#define NODE_ROOT		NODE(NODE_KIND_SPECIAL, 1)
+
+/*
+ * Called for every directory entry, with the offset to resume from
+ * after this entry. Returns non zero when the caller's buffer is full.
+ */
+typedef int (*node_fill_t)(void *ctx, const char *name, uint64_t node,
+			   off_t next);
+
+#define NODE_SNAPSHOT_SIZE	256
+
+/*
+ * State of an open file, kept in fuse_file_info's fh. snapshot holds the
+ * content formatted by the last read at offset 0. Most files are opened
+ * with direct_io and report a zero size, so reads are never cut short by
+ * it. Files captured at open instead have their real size and may go
+ * through the page cache. The watch fields are owned by watch.c and
+ * only used once the file has been polled. posted is set once a write
+ * to the file was queued by writeback.c, so closing it syncs. lock
+ * serializes requests on the same open file, which may arrive on any
+ * FUSE worker, over the snapshot, posted and priv.
+ */
+struct node_handle {
+	uint64_t node;
+	pthread_mutex_t lock;
+	struct reg_handle reg;
+	void *priv;
+	int direct_io;
+	int snapshot_valid;
+	size_t snapshot_len;
+	size_t snapshot_size;
+	char *snapshot;
+	int watched;
+	uint64_t watch_gen;
+	void *poll_handle;
+	struct node_handle *watch_next;
+	int posted;
+};
+
+int node_is_dir(struct soc_private *private, uint64_t node);
+int node_lookup(struct soc_private *private, uint64_t parent,
+		const char *name, uint64_t *node);
+int node_getattr(struct soc_private *private, uint64_t node,
+		 struct stat *stbuf);
+int node_readdir(struct soc_private *private, uint64_t node, off_t offset,
+		 node_fill_t fill, void *ctx);
+int node_open(struct soc_private *private, uint64_t node, int flags,
+	      struct node_handle **handle);
+int node_flush(struct soc_private *private, struct node_handle *handle);
+int node_fsync(struct soc_private *private, struct node_handle *handle);
+void node_release(struct soc_private *private, struct node_handle *handle);
+int node_read(struct soc_private *private, struct node_handle *handle,
+	      char *buf, size_t size, off_t offset);
+int node_write(struct soc_private *private, struct node_handle *handle,
+	       const char *buf, size_t size, off_t offset);
+int node_poll(struct soc_private *private, struct node_handle *handle,
+	      void *ph, unsigned int *revents);
+int node_ioctl(struct soc_private *private, uint64_t node,
+	       struct node_handle *handle, unsigned int cmd, void *data);
+
+/* Control files */
+#define BATCH_LOG_SIZE		(16 << 10)
+#define BATCH_SHOW_SIZE		(BATCH_LOG_SIZE + 64)
+
+struct batch;
+
+struct batch *batch_new(void);
+void batch_free(struct batch *batch);
+int batch_write(struct soc_private *private, struct batch *batch,
+		const char *buf, size_t size);
+int batch_flush(struct soc_private *private, struct batch *batch);
+int batch_show(struct batch *batch, char *buf, size_t size);
+
+struct query;
+
+struct query *query_new(void);
+void query_free(struct soc_private *private, struct query *query);
+int query_write(struct soc_private *private, struct query *query,
+		const char *buf, size_t size);
+int query_flush(struct soc_private *private, struct query *query);
+size_t query_show_size(struct query *query);
+int query_show(struct soc_private *private, struct query *query, char *buf,
+	       size_t size);
+
+struct waiter;
+
+struct waiter *waiter_new(void);
+void waiter_free(struct waiter *waiter);
+int waiter_write(struct soc_private *private, struct waiter *waiter,
+		 const char *buf, size_t size);
+int waiter_show(struct waiter *waiter, char *buf, size_t size);
+
+struct invalidate;
+
+struct invalidate *invalidate_new(void);
+void invalidate_free(struct invalidate *invalidate);
+int invalidate_write(struct soc_private *private,
+		     struct invalidate *invalidate, const char *buf,
+		     size_t size);
+int invalidate_flush(struct soc_private *private,
+		     struct invalidate *invalidate);
+
+/* Poll support, see watch.c. A frontend poll handle is notified once */
+typedef void (*watch_fn_t)(void *ph);
+
+int watch_init(struct soc_private *private, watch_fn_t notify,
+	       watch_fn_t destroy);
+void watch_stop(struct soc_private *private);
+int watch_poll(struct soc_private *private, struct node_handle *handle,
+	       void *ph);
+void watch_seen(struct soc_private *private, struct node_handle *handle);
+void watch_drop(struct soc_private *private, void *ph);
+void watch_release(struct soc_private *private, struct node_handle *handle);
+
+#endif /* NODE_H */
@@ -0,0 +1,246 @@
+#include <errno.h>
+#include <fnmatch.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "misc.h"
+#include "node.h"
+
+/*
+ * The /.query control file. Writes add "top/reg" paths or fnmatch(3)
+ * patterns such as "uart[0-9]/STATUS", one per line, to the query of the
+ * open file. They are resolved and mapped once, when written; a write
+ * holding a line that matches nothing fails with ENOENT and adds none
+ * of its lines. Every read from offset 0 then samples all registers of
+ * the query back to back before formatting them as "top/reg value"
+ * lines, in query order.
+ */
+
+struct query {
+	struct line_buf input;
+	uint32_t *regs;
+	uint32_t *tops;
+	uint32_t count;
+	uint32_t capacity;
+	uint32_t pending;	/* entries added by the current write */
+	int err;
+	size_t show_size;
+	struct reg_set set;
+	uint64_t *values;
+	uint64_t *valid;
+};
+
+struct query_ctx {
+	struct soc_private *private;
+	struct query *query;
+};
+
+struct query *query_new(void)
+{
+	return calloc(1, sizeof(struct query));
+}
+
+void query_free(struct soc_private *private, struct query *query)
+{
+	reg_set_unmap(private, &query->set);
+	free(query->regs);
+	free(query->tops);
+	free(query->values);
+	free(query->valid);
+	free(query);
+}
+
+static int query_append(struct query *query, uint32_t top, uint32_t reg)
+{
+	uint32_t count = query->count + query->pending;
+	uint32_t capacity, *regs, *tops;
+
+	/* Grow both arrays before committing the new capacity */
+	if (count == query->capacity) {
+		capacity = query->capacity ? 2 * query->capacity : 64;
+		regs = realloc(query->regs, capacity * sizeof(*query->regs));
+		if (!regs)
+			return -ENOMEM;
+		query->regs = query->set.regs = regs;
+		tops = realloc(query->tops, capacity * sizeof(*query->tops));
+		if (!tops)
+			return -ENOMEM;
+		query->tops = tops;
+		query->capacity = capacity;
+	}
+
+	query->regs[count] = reg;
+	query->tops[count] = top;
+	query->pending++;
+
+	return 0;
+}
+
+static int query_glob(struct soc_private *private, struct query *query,
+		      char *pattern)
+{
+	const struct soc_schema *schema = &private->schema;
+	uint32_t top, i, reg, pending = query->pending;
+	char *sep = strchr(pattern, '/');
+	int ret;
+
+	if (!sep)
+		return -EINVAL;
+	*sep = '\0';
+
+	for (top = 0; top < schema->top_count; top++) {
+		if (fnmatch(pattern, top_name(schema, top), 0))
+			continue;
+
+		for (i = 0; i < schema->tops[top].reg_count; i++) {
+			reg = schema->tops[top].first_reg + i;
+			if (fnmatch(sep + 1, reg_name(schema, reg), 0))
+				continue;
+
+			ret = query_append(query, top, reg);
+			if (ret)
+				return ret;
+		}
+	}
+
+	return query->pending > pending ? 0 : -ENOENT;
+}
+
+static int query_add(void *ctx, char *line, int err)
+{
+	struct query_ctx *query_ctx = ctx;
+	struct soc_private *private = query_ctx->private;
+	struct query *query = query_ctx->query;
+	int reg, top;
+
+	if (!err) {
+		line = strip(line);
+		if (*line == '/')
+			line++;
+		if (!*line)
+			return 0;
+
+		if (strpbrk(line, "*?[")) {
+			err = query_glob(private, query, line);
+		} else {
+			reg = index_find_reg(&private->index, &private->schema,
+					     line);
+			top = index_find_top(&private->index,
+					     &private->schema, line,
+					     strcspn(line, "/"));
+			if (reg < 0 || top < 0)
+				err = -ENOENT;
+			else
+				err = query_append(query, top, reg);
+		}
+	}
+
+	/* Keep going, so the whole write is consumed */
+	if (err && !query->err)
+		query->err = err;
+
+	return 0;
+}
+
+/* Keep the lines added by the current write, and map the new query */
+static int query_commit(struct soc_private *private, struct query *query)
+{
+	const struct soc_schema *schema = &private->schema;
+	uint32_t i, count = query->count + query->pending;
+	uint64_t *values, *valid;
+	int ret = query->err;
+
+	query->pending = 0;
+	query->err = 0;
+	if (ret || count == query->count)
+		return ret;
+
+	values = realloc(query->values, count * sizeof(*values));
+	if (values)
+		query->values = values;
+	valid = realloc(query->valid, (count + 63) / 64 * sizeof(*valid));
+	if (valid)
+		query->valid = valid;
+	if (!values || !valid)
+		return -ENOMEM;
+
+	reg_set_unmap(private, &query->set);
+	query->set.regs = query->regs;
+	query->set.count = count;
+	ret = reg_set_map(private, &query->set);
+	if (ret) {
+		query->set.count = 0;
+		return ret;
+	}
+
+	for (i = query->count; i < count; i++)
+		query->show_size += strlen(top_name(schema, query->tops[i])) +
+				    strlen(reg_name(schema, query->regs[i])) +
+				    24;
+	query->count = count;
+
+	return 0;
+}
+
+int query_write(struct soc_private *private, struct query *query,
+		const char *buf, size_t size)
+{
+	struct query_ctx ctx = { private, query };
+	int ret;
+
+	line_buf_split(&query->input, buf, size, query_add, &ctx);
+	ret = query_commit(private, query);
+
+	return ret ? ret : size;
+}
+
+/* Add a last line that wasn't terminated by a newline */
+int query_flush(struct soc_private *private, struct query *query)
+{
+	struct query_ctx ctx = { private, query };
+
+	line_buf_finish(&query->input, query_add, &ctx);
+
+	return query_commit(private, query);
+}
+
+size_t query_show_size(struct query *query)
+{
+	return query->show_size + 1;
+}
+
+int query_show(struct soc_private *private, struct query *query, char *buf,
+	       size_t size)
+{
+	const struct soc_schema *schema = &private->schema;
+	size_t len = 0;
+	uint32_t i;
+	int ret;
+
+	if (!query->count)
+		return 0;
+
+	/* Sample everything first, formatting is slow in comparison */
+	memset(query->valid, 0, (query->count + 63) / 64 *
+	       sizeof(*query->valid));
+	reg_set_read(private, &query->set, query->values, query->valid);
+
+	for (i = 0; i < query->count && len < size; i++) {
+		if (query->valid[i / 64] & (1ULL << (i % 64)))
+			ret = snprintf(buf + len, size - len,
+				       "%s/%s 0x%" PRIx64 "\n",
+				       top_name(schema, query->tops[i]),
+				       reg_name(schema, query->regs[i]),
+				       query->values[i]);
+		else
+			ret = snprintf(buf + len, size - len, "%s/%s -\n",
+				       top_name(schema, query->tops[i]),
+				       reg_name(schema, query->regs[i]));
+		if (ret < 0)
+			break;
+		len += ret;
+	}
+
+	return len < size ? len : size - 1;
+}
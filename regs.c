@@ -0,0 +1,703 @@
+#include <errno.h>
+#include <sched.h>
+#include <stdlib.h>
+#include "soc.h"
+
+struct reg_order {
+	uint64_t addr;
+	uint32_t reg;
+};
+
+static int order_cmp(const void *a, const void *b)
+{
+	const struct reg_order *x = a, *y = b;
+
+	if (x->addr != y->addr)
+		return x->addr < y->addr ? -1 : 1;
+	return x->reg < y->reg ? -1 : x->reg > y->reg;
+}
+
+/* Sort the register ids by address, for captures walking the whole chip */
+static int reg_table_order(struct reg_table *regs)
+{
+	struct reg_order *order;
+	uint32_t i;
+
+	regs->order = calloc(regs->count, sizeof(*regs->order));
+	order = calloc(regs->count, sizeof(*order));
+	if (regs->count && (!regs->order || !order)) {
+		free(order);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < regs->count; i++) {
+		order[i].addr = regs->addr[i];
+		order[i].reg = i;
+	}
+	qsort(order, regs->count, sizeof(*order), order_cmp);
+	for (i = 0; i < regs->count; i++)
+		regs->order[i] = order[i].reg;
+
+	free(order);
+	return 0;
+}
+
+/* Index every register's first field, fields being sorted by register */
+static int reg_table_fields(struct reg_table *regs,
+			    const struct soc_schema *schema)
+{
+	uint32_t reg, field = 0;
+
+	regs->first_field = calloc(regs->count + 1,
+				   sizeof(*regs->first_field));
+	if (!regs->first_field)
+		return -ENOMEM;
+
+	for (reg = 0; reg <= regs->count; reg++) {
+		while (field < schema->field_count &&
+		       schema->fields[field].reg < reg)
+			field++;
+		regs->first_field[reg] = field;
+	}
+
+	return 0;
+}
+
+int reg_table_init(struct reg_table *regs, const struct soc_schema *schema)
+{
+	uint32_t i;
+	int ret;
+
+	regs->count = schema->reg_count;
+	regs->addr = calloc(regs->count, sizeof(*regs->addr));
+	regs->virt = calloc(regs->count, sizeof(*regs->virt));
+	regs->width = calloc(regs->count, sizeof(*regs->width));
+	regs->flags = calloc(regs->count, sizeof(*regs->flags));
+	regs->cache = calloc(regs->count, sizeof(*regs->cache));
+	regs->cache_valid = calloc(regs->count, sizeof(*regs->cache_valid));
+	regs->flights = calloc(regs->count, sizeof(*regs->flights));
+
+	atomic_init(&regs->cache_hits, 0);
+	atomic_init(&regs->cache_misses, 0);
+	atomic_init(&regs->coalesced, 0);
+
+	/* Set up by reg_sweep_init(), if at all */
+	regs->sweeps = NULL;
+	regs->top = NULL;
+	regs->max_staleness_ns = 0;
+	atomic_init(&regs->stale_hits, 0);
+	atomic_init(&regs->sweep_count, 0);
+
+	if (regs->count &&
+	    (!regs->addr || !regs->virt || !regs->width || !regs->flags ||
+	     !regs->cache || !regs->cache_valid || !regs->flights))
+		return -ENOMEM;
+
+	for (i = 0; i < regs->count; i++) {
+		const struct soc_reg *reg = &schema->regs[i];
+
+		regs->addr[i] = reg->addr;
+		regs->width[i] = reg->width / 8;
+
+		switch (reg->width) {
+		case 8:
+		case 16:
+		case 32:
+		case 64:
+			regs->flags[i] = REG_READABLE | REG_WRITABLE;
+			break;
+		default:
+			/* Unsupported width, refuse any access */
+			regs->flags[i] = 0;
+			break;
+		}
+
+		switch (SOC_REG_ACCESS(reg->flags)) {
+		case SOC_REG_RO:
+			regs->flags[i] &= ~REG_WRITABLE;
+			break;
+		case SOC_REG_WO:
+			/* Never read, the cache holds the shadow instead */
+			regs->flags[i] &= ~REG_READABLE;
+			continue;
+		case SOC_REG_W1C:
+			regs->flags[i] |= REG_W1C;
+			break;
+		}
+
+		if (reg->flags & SOC_REG_CONST)
+			regs->flags[i] |= REG_CONST;
+		else if ((reg->flags & SOC_REG_NONVOLATILE) &&
+			 !(regs->flags[i] & REG_W1C))
+			regs->flags[i] |= REG_NONVOLATILE;
+		else if (reg->flags & SOC_REG_READ_CLEAR)
+			regs->flags[i] |= REG_READ_CLEAR;
+	}
+
+	for (i = 0; i < REG_LOCK_STRIPES; i++)
+		pthread_mutex_init(&regs->locks[i], NULL);
+
+	ret = reg_table_fields(regs, schema);
+	if (ret)
+		return ret;
+
+	return reg_table_order(regs);
+}
+
+/* Point registers inside a permanently mapped aperture at their address */
+void reg_table_map(struct reg_table *regs, struct mem_cache *mem)
+{
+	uint32_t i;
+
+	for (i = 0; i < regs->count; i++)
+		regs->virt[i] = mem_aperture_lookup(mem, regs->addr[i],
+						    regs->width[i]);
+}
+
+static uint64_t width_mask(unsigned int width)
+{
+	return width < 8 ? (1ULL << (8 * width)) - 1 : ~0ULL;
+}
+
+/* The cached value of a constant or non-volatile register, if any */
+static int cache_get(struct reg_table *regs, uint32_t reg, uint64_t *value)
+{
+	int hit;
+
+	if (!(regs->flags[reg] & REG_CACHED))
+		return 0;
+
+	pthread_mutex_lock(reg_lock(regs, reg));
+	hit = regs->cache_valid[reg];
+	if (hit)
+		*value = regs->cache[reg];
+	pthread_mutex_unlock(reg_lock(regs, reg));
+
+	if (hit)
+		atomic_fetch_add(&regs->cache_hits, 1);
+
+	return hit;
+}
+
+/* Spins before yielding while waiting for another thread's read */
+#define FLIGHT_SPINS	64
+
+/*
+ * Read a volatile register, or share the result of a read of it already
+ * in flight. The thread moving seq from even to odd reads the hardware
+ * and moves it on by one once value holds the result. Writes move seq
+ * by two, so readers that find it odd wait for it to change and take
+ * value only when the flight ended with no write since they joined;
+ * otherwise the read may predate the write, and they start over. A
+ * flight that saw a write ends by moving seq by three, so readers that
+ * joined after the write don't mistake it for a clean one. Read-clear
+ * registers are always read on their own, as every read must reach the
+ * hardware.
+ */
+static uint64_t read_shared(struct reg_table *regs, uint32_t reg,
+			    volatile void *virt)
+{
+	struct reg_flight *flight = &regs->flights[reg];
+	uint64_t seq, expected, value;
+	unsigned int spins = 0;
+
+	if (regs->flags[reg] & REG_READ_CLEAR)
+		return mem_read(virt, regs->width[reg]);
+
+	for (;;) {
+		seq = atomic_load_explicit(&flight->seq, memory_order_acquire);
+		if (!(seq & 1)) {
+			if (!atomic_compare_exchange_strong_explicit(
+				    &flight->seq, &seq, seq + 1,
+				    memory_order_acquire, memory_order_relaxed))
+				continue;
+
+			value = mem_read(virt, regs->width[reg]);
+			atomic_store_explicit(&flight->value, value,
+					      memory_order_relaxed);
+			expected = seq + 1;
+			if (!atomic_compare_exchange_strong_explicit(
+				    &flight->seq, &expected, seq + 2,
+				    memory_order_release, memory_order_relaxed))
+				atomic_fetch_add_explicit(&flight->seq, 3,
+							  memory_order_release);
+			return value;
+		}
+
+		while (atomic_load_explicit(&flight->seq,
+					    memory_order_acquire) == seq)
+			if (++spins % FLIGHT_SPINS == 0)
+				sched_yield();
+
+		if (atomic_load_explicit(&flight->seq, memory_order_acquire) ==
+		    seq + 1) {
+			atomic_fetch_add_explicit(&regs->coalesced, 1,
+						  memory_order_relaxed);
+			return atomic_load_explicit(&flight->value,
+						    memory_order_relaxed);
+		}
+	}
+}
+
+/* Read the hardware, filling the cache of cached registers */
+static uint64_t read_fill(struct reg_table *regs, uint32_t reg,
+			  volatile void *virt)
+{
+	uint64_t value;
+
+	if (!(regs->flags[reg] & REG_CACHED))
+		return read_shared(regs, reg, virt);
+
+	pthread_mutex_lock(reg_lock(regs, reg));
+	if (regs->cache_valid[reg]) {
+		value = regs->cache[reg];
+	} else {
+		value = mem_read(virt, regs->width[reg]);
+		regs->cache[reg] = value;
+		regs->cache_valid[reg] = 1;
+		atomic_fetch_add(&regs->cache_misses, 1);
+	}
+	pthread_mutex_unlock(reg_lock(regs, reg));
+
+	return value;
+}
+
+/*
+ * Write with the register's lock held. Non-volatile and write-only
+ * registers keep the value written; a constant one is read back from
+ * the hardware.
+ */
+static void write_through(struct reg_table *regs, uint32_t reg,
+			  volatile void *virt, uint64_t value)
+{
+	mem_write(virt, regs->width[reg], value);
+	reg_sweep_expire(regs, reg);
+
+	/* Reads in flight may predate the write, don't let others join them */
+	atomic_fetch_add_explicit(&regs->flights[reg].seq, 2,
+				  memory_order_release);
+
+	if ((regs->flags[reg] & REG_NONVOLATILE) ||
+	    !(regs->flags[reg] & REG_READABLE)) {
+		regs->cache[reg] = value & width_mask(regs->width[reg]);
+		regs->cache_valid[reg] = 1;
+	} else {
+		regs->cache_valid[reg] = 0;
+	}
+}
+
+int reg_read(struct soc_private *private, uint32_t reg, uint64_t *value)
+{
+	struct reg_table *regs = &private->regs;
+	struct mem_ref map;
+
+	if (!(regs->flags[reg] & REG_READABLE))
+		return -EACCES;
+
+	if (cache_get(regs, reg, value))
+		return 0;
+
+	if (regs->virt[reg]) {
+		*value = read_fill(regs, reg, regs->virt[reg]);
+		return 0;
+	}
+
+	if (mem_get(&private->mem, regs->addr[reg], regs->width[reg], &map))
+		return -EFAULT;
+
+	*value = read_fill(regs, reg, map.virt_addr);
+	mem_put(&private->mem, &map);
+
+	return 0;
+}
+
+int reg_write(struct soc_private *private, uint32_t reg, uint64_t value)
+{
+	struct reg_table *regs = &private->regs;
+	struct mem_ref map;
+
+	if (!(regs->flags[reg] & REG_WRITABLE))
+		return -EACCES;
+
+	if (regs->virt[reg]) {
+		pthread_mutex_lock(reg_lock(regs, reg));
+		write_through(regs, reg, regs->virt[reg], value);
+		pthread_mutex_unlock(reg_lock(regs, reg));
+		return 0;
+	}
+
+	if (mem_get(&private->mem, regs->addr[reg], regs->width[reg], &map))
+		return -EFAULT;
+
+	pthread_mutex_lock(reg_lock(regs, reg));
+	write_through(regs, reg, map.virt_addr, value);
+	pthread_mutex_unlock(reg_lock(regs, reg));
+	mem_put(&private->mem, &map);
+
+	return 0;
+}
+
+/*
+ * Read a register back from the hardware, bypassing every cache, so
+ * the writes issued before have reached the device.
+ */
+int reg_fence(struct soc_private *private, uint32_t reg)
+{
+	struct reg_table *regs = &private->regs;
+	struct mem_ref map;
+
+	if (!(regs->flags[reg] & REG_READABLE))
+		return -EACCES;
+
+	mem_barrier();
+	if (regs->virt[reg]) {
+		mem_read(regs->virt[reg], regs->width[reg]);
+		return 0;
+	}
+
+	if (mem_get(&private->mem, regs->addr[reg], regs->width[reg], &map))
+		return -EFAULT;
+	mem_read(map.virt_addr, regs->width[reg]);
+	mem_put(&private->mem, &map);
+
+	return 0;
+}
+
+/* Replace the bits of mask with those of bits, then flip those of flip */
+static uint64_t update(struct reg_table *regs, uint32_t reg,
+		       volatile void *virt, uint64_t mask, uint64_t bits,
+		       uint64_t flip)
+{
+	uint64_t value;
+
+	pthread_mutex_lock(reg_lock(regs, reg));
+	value = mem_read(virt, regs->width[reg]);
+	if (regs->flags[reg] & REG_W1C) {
+		/* Ones clear bits, so only write those being cleared */
+		value &= ~mask;
+		write_through(regs, reg, virt, mask);
+	} else {
+		value = ((value & ~mask) | (bits & mask)) ^ flip;
+		write_through(regs, reg, virt, value);
+	}
+	pthread_mutex_unlock(reg_lock(regs, reg));
+
+	return value;
+}
+
+/*
+ * Read-modify-writes need a readable register. Bits of a write 1 to
+ * clear register can be cleared, but not set or toggled.
+ */
+static int update_check(uint8_t flags, uint64_t mask, uint64_t bits,
+			uint64_t flip)
+{
+	if ((flags & (REG_READABLE | REG_WRITABLE)) !=
+	    (REG_READABLE | REG_WRITABLE))
+		return -EACCES;
+	if ((flags & REG_W1C) && ((bits & mask) || flip))
+		return -EACCES;
+
+	return 0;
+}
+
+/*
+ * Replace the bits of mask with those of bits, atomically with respect
+ * to every other write of the register made through socfs. result gets
+ * the value written.
+ */
+int reg_update(struct soc_private *private, uint32_t reg, uint64_t mask,
+	       uint64_t bits, uint64_t *result)
+{
+	struct reg_table *regs = &private->regs;
+	struct mem_ref map;
+	uint64_t value;
+	int ret;
+
+	ret = update_check(regs->flags[reg], mask, bits, 0);
+	if (ret)
+		return ret;
+
+	if (regs->virt[reg]) {
+		value = update(regs, reg, regs->virt[reg], mask, bits, 0);
+	} else {
+		if (mem_get(&private->mem, regs->addr[reg], regs->width[reg],
+			    &map))
+			return -EFAULT;
+		value = update(regs, reg, map.virt_addr, mask, bits, 0);
+		mem_put(&private->mem, &map);
+	}
+
+	if (result)
+		*result = value;
+
+	return 0;
+}
+
+/* Drop the cached value or shadow of a register, and its top's sweep */
+void reg_invalidate(struct reg_table *regs, uint32_t reg)
+{
+	reg_sweep_expire(regs, reg);
+
+	if (!(regs->flags[reg] & REG_CACHED) &&
+	    (regs->flags[reg] & REG_READABLE))
+		return;
+
+	pthread_mutex_lock(reg_lock(regs, reg));
+	regs->cache_valid[reg] = 0;
+	pthread_mutex_unlock(reg_lock(regs, reg));
+}
+
+int reg_open(struct soc_private *private, uint32_t reg,
+	     struct reg_handle *handle)
+{
+	struct reg_table *regs = &private->regs;
+
+	handle->regs = regs;
+	handle->reg = reg;
+	handle->width = regs->width[reg];
+	handle->flags = regs->flags[reg];
+	handle->virt = regs->virt[reg];
+	handle->map.window = NULL;
+	handle->map.map_base = NULL;
+
+	/* Nothing to map for registers that can't be accessed */
+	if (handle->virt || !(handle->flags & (REG_READABLE | REG_WRITABLE)))
+		return 0;
+
+	/* Pins the register's cache window for as long as the file is open */
+	if (mem_get(&private->mem, regs->addr[reg], handle->width,
+		    &handle->map))
+		return -EFAULT;
+
+	handle->virt = handle->map.virt_addr;
+
+	return 0;
+}
+
+void reg_close(struct soc_private *private, struct reg_handle *handle)
+{
+	mem_put(&private->mem, &handle->map);
+}
+
+int reg_handle_read(struct reg_handle *handle, uint64_t *value)
+{
+	if (!(handle->flags & REG_READABLE))
+		return -EACCES;
+
+	if (!cache_get(handle->regs, handle->reg, value))
+		*value = read_fill(handle->regs, handle->reg, handle->virt);
+
+	return 0;
+}
+
+/*
+ * The last value written to a write-only register through socfs, which
+ * is never read from the hardware. -ENODATA until the first write.
+ */
+int reg_shadow(struct reg_table *regs, uint32_t reg, uint64_t *value)
+{
+	int ret = -ENODATA;
+
+	if ((regs->flags[reg] & (REG_READABLE | REG_WRITABLE)) != REG_WRITABLE)
+		return -EACCES;
+
+	pthread_mutex_lock(reg_lock(regs, reg));
+	if (regs->cache_valid[reg]) {
+		*value = regs->cache[reg];
+		ret = 0;
+	}
+	pthread_mutex_unlock(reg_lock(regs, reg));
+
+	return ret;
+}
+
+int reg_handle_shadow(struct reg_handle *handle, uint64_t *value)
+{
+	return reg_shadow(handle->regs, handle->reg, value);
+}
+
+int reg_handle_write(struct reg_handle *handle, uint64_t value)
+{
+	pthread_mutex_t *lock = reg_lock(handle->regs, handle->reg);
+
+	if (!(handle->flags & REG_WRITABLE))
+		return -EACCES;
+
+	pthread_mutex_lock(lock);
+	write_through(handle->regs, handle->reg, handle->virt, value);
+	pthread_mutex_unlock(lock);
+
+	return 0;
+}
+
+int reg_handle_update(struct reg_handle *handle, uint64_t mask, uint64_t bits,
+		      uint64_t *result)
+{
+	uint64_t value;
+	int ret;
+
+	ret = update_check(handle->flags, mask, bits, 0);
+	if (ret)
+		return ret;
+
+	value = update(handle->regs, handle->reg, handle->virt, mask, bits, 0);
+	if (result)
+		*result = value;
+
+	return 0;
+}
+
+int reg_handle_toggle(struct reg_handle *handle, uint64_t mask)
+{
+	int ret;
+
+	ret = update_check(handle->flags, 0, 0, mask);
+	if (ret)
+		return ret;
+
+	update(handle->regs, handle->reg, handle->virt, 0, 0, mask);
+
+	return 0;
+}
+
+/* Find a register by address, in the table's address order */
+int reg_find_addr(struct reg_table *regs, uint64_t addr)
+{
+	uint32_t lo = 0, hi = regs->count, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (regs->addr[regs->order[mid]] < addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo == regs->count || regs->addr[regs->order[lo]] != addr)
+		return -1;
+
+	return regs->order[lo];
+}
+
+/* Larger runs are split, so a sparse set doesn't map huge holes */
+#define REG_RUN_MAX_SPAN	(16UL << 20)
+
+/*
+ * Map the registers of set->regs, which the caller fills in. The
+ * registers are walked in address order, which is set order when the
+ * caller already sorted them.
+ */
+int reg_set_map(struct soc_private *private, struct reg_set *set)
+{
+	struct reg_table *regs = &private->regs;
+	struct reg_order *order;
+	struct reg_run *run = NULL;
+	uint32_t *run_of;
+	uint32_t i, reg;
+
+	set->run_count = 0;
+	set->virt = calloc(set->count + 1, sizeof(*set->virt));
+	set->runs = calloc(set->count + 1, sizeof(*set->runs));
+	order = malloc((set->count + 1) * sizeof(*order));
+	run_of = malloc((set->count + 1) * sizeof(*run_of));
+	if (!set->virt || !set->runs || !order || !run_of) {
+		free(order);
+		free(run_of);
+		reg_set_unmap(private, set);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < set->count; i++) {
+		order[i].addr = regs->addr[set->regs[i]];
+		order[i].reg = i;
+	}
+	for (i = 1; i < set->count; i++)
+		if (order[i].addr < order[i - 1].addr)
+			break;
+	if (i < set->count)
+		qsort(order, set->count, sizeof(*order), order_cmp);
+
+	for (i = 0; i < set->count; i++) {
+		reg = set->regs[order[i].reg];
+		if (!(regs->flags[reg] & REG_READABLE) || regs->virt[reg])
+			continue;
+
+		if (!run || regs->addr[reg] > run->end + APERTURE_MAX_GAP ||
+		    regs->addr[reg] + regs->width[reg] - run->start >
+		    REG_RUN_MAX_SPAN) {
+			run = &set->runs[set->run_count++];
+			run->start = regs->addr[reg];
+			run->end = run->start;
+		}
+		if (regs->addr[reg] + regs->width[reg] > run->end)
+			run->end = regs->addr[reg] + regs->width[reg];
+		run_of[order[i].reg] = run - set->runs;
+	}
+
+	for (i = 0; i < set->run_count; i++) {
+		run = &set->runs[i];
+		run->mapped = !mem_map(&private->mem, run->start,
+				       run->end - run->start, &run->map);
+	}
+
+	for (i = 0; i < set->count; i++) {
+		reg = set->regs[i];
+		if (!(regs->flags[reg] & REG_READABLE))
+			continue;
+		if (regs->virt[reg]) {
+			set->virt[i] = regs->virt[reg];
+			continue;
+		}
+
+		/* Only readable registers outside apertures have a run */
+		run = &set->runs[run_of[i]];
+		if (run->mapped)
+			set->virt[i] = (char *)run->map.virt_addr +
+				       (regs->addr[reg] - run->start);
+	}
+
+	free(order);
+	free(run_of);
+	return 0;
+}
+
+void reg_set_unmap(struct soc_private *private, struct reg_set *set)
+{
+	uint32_t i;
+
+	for (i = 0; set->runs && i < set->run_count; i++)
+		if (set->runs[i].mapped)
+			mem_put(&private->mem, &set->runs[i].map);
+
+	free(set->runs);
+	free(set->virt);
+	set->runs = NULL;
+	set->virt = NULL;
+	set->run_count = 0;
+}
+
+/*
+ * Read every register of a mapped set into values, in set order. valid
+ * gets a bit set for every register actually read. Registers whose run
+ * couldn't be mapped fall back to the mapping cache. Read-clear ones are
+ * left out, a capture mustn't clear what a driver is waiting for.
+ */
+void reg_set_read(struct soc_private *private, struct reg_set *set,
+		  uint64_t *values, uint64_t *valid)
+{
+	struct reg_table *regs = &private->regs;
+	uint32_t i, reg;
+
+	for (i = 0; i < set->count; i++) {
+		reg = set->regs[i];
+		if (!(regs->flags[reg] & REG_READABLE) ||
+		    (regs->flags[reg] & REG_READ_CLEAR))
+			continue;
+		if (set->virt[i])
+			values[i] = mem_read(set->virt[i], regs->width[reg]);
+		else if (reg_read(private, reg, &values[i]))
+			continue;
+		valid[i / 64] |= 1ULL << (i % 64);
+	}
+}
@@ -0,0 +1,395 @@
+#ifndef SOC_H
+#define SOC_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "mem.h"
+
+#define SOC_MAGIC 0x57a32bcd
+
+/* Version 1: fixed size names, tops chained through next_offset */
+#define MAX_SOC_NAME 32
+#define MAX_REG_NAME 64
+#define MAX_TOP_NAME 32
+
+struct reg_v1 {
+	char name[MAX_REG_NAME];
+	uint64_t addr;
+	uint32_t width;
+} __attribute__((packed));
+
+struct top_v1 {
+	char name[MAX_TOP_NAME];
+	uint32_t reg_count;
+	uint32_t next_offset;
+	struct reg_v1 regs[];
+} __attribute__((packed));
+
+struct soc_header_v1 {
+	uint32_t magic;
+	uint32_t version;
+	char soc_name[MAX_SOC_NAME];
+	uint32_t top_count;
+	struct top_v1 tops[];
+} __attribute__((packed));
+
+/*
+ * Version 2: a section table with 64 bit file offsets, fixed size top
+ * and register records and a deduplicated pool of NUL terminated names.
+ * Names are referenced by their byte offset in the string section and
+ * the registers of a top are contiguous in the register section.
+ */
+#define SOC_SECTION_STRINGS	1
+#define SOC_SECTION_TOPS	2
+#define SOC_SECTION_REGS	3
+#define SOC_SECTION_PHF		4
+#define SOC_SECTION_FIELDS	5
+
+struct soc_section {
+	uint32_t type;
+	uint32_t reserved;
+	uint64_t offset;
+	uint64_t size;
+};
+
+struct soc_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t name;
+	uint32_t top_count;
+	uint32_t reg_count;
+	uint32_t section_count;
+	struct soc_section sections[];
+};
+
+struct soc_top {
+	uint32_t name;
+	uint32_t reg_count;
+	uint32_t first_reg;
+	uint32_t reserved;
+};
+
+/* soc_reg flags, registers are volatile unless told otherwise */
+#define SOC_REG_CONST		(1 << 0)	/* never changes */
+#define SOC_REG_NONVOLATILE	(1 << 1)	/* only changes when written */
+#define SOC_REG_READ_CLEAR	(1 << 2)	/* reading has side effects */
+
+/* Access type in bits 3-4 of soc_reg flags, read-write by default */
+#define SOC_REG_ACCESS(flags)	(((flags) >> 3) & 3)
+#define SOC_REG_RW		0
+#define SOC_REG_RO		1	/* writes are refused */
+#define SOC_REG_WO		2	/* reads return the last value written */
+#define SOC_REG_W1C		3	/* writing ones clears those bits */
+
+struct soc_reg {
+	uint64_t addr;
+	uint32_t name;
+	uint16_t width;
+	uint16_t flags;
+};
+
+/*
+ * Optional bit fields, sorted by register. A field covers width bits of
+ * its register starting at bit lsb; access holds SOC_FIELD_READ and
+ * SOC_FIELD_WRITE.
+ */
+#define SOC_FIELD_READ		(1 << 0)
+#define SOC_FIELD_WRITE		(1 << 1)
+
+struct soc_field {
+	uint32_t name;
+	uint32_t reg;
+	uint8_t lsb;
+	uint8_t width;
+	uint16_t access;
+	uint32_t reserved;
+};
+
+/*
+ * Optional minimal perfect hash over every top name and "top/reg" path,
+ * built by soc_convert.py so lookups need no table built at mount time.
+ * A key's 64 bit FNV-1a hash selects a bucket, and the bucket's seed
+ * either names its slot directly (SOC_PHF_DIRECT) or is mixed into the
+ * hash to pick one. seeds[] is followed by slot_count slot values: a
+ * register id, or a top id with SOC_PHF_TOP set.
+ */
+#define SOC_PHF_DIRECT		0x80000000
+#define SOC_PHF_TOP		0x80000000
+#define SOC_PHF_SEED_MULT	0x9e3779b97f4a7c15ULL
+
+struct soc_phf {
+	uint32_t bucket_count;
+	uint32_t slot_count;
+	uint32_t seeds[];
+};
+
+/*
+ * Layout of the /.snapshot file, in host byte order. The header is
+ * followed by reg_count 64 bit values indexed by register id, starting
+ * at values_offset, then by a bitmap of (reg_count + 63) / 64 words with
+ * a bit set for every register that was actually read. Timestamps are
+ * CLOCK_REALTIME nanoseconds taken around the capture.
+ */
+#define SOC_SNAPSHOT_MAGIC	0x70616e73	/* "snap" */
+#define SOC_SNAPSHOT_VERSION	1
+
+struct soc_snapshot_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t reg_count;
+	uint32_t values_offset;
+	uint64_t start_ns;
+	uint64_t end_ns;
+};
+
+/*
+ * The loaded schema. It always has the version 2 layout: a version 2
+ * file is used in place, a version 1 file is converted on load.
+ */
+struct soc_schema {
+	const char *strings;
+	size_t strings_size;
+	const char *name;
+	const struct soc_top *tops;
+	uint32_t top_count;
+	const struct soc_reg *regs;
+	uint32_t reg_count;
+	const struct soc_phf *phf;
+	const struct soc_field *fields;
+	uint32_t field_count;
+};
+
+static inline const char *top_name(const struct soc_schema *schema,
+				   uint32_t top)
+{
+	return schema->strings + schema->tops[top].name;
+}
+
+static inline const char *reg_name(const struct soc_schema *schema,
+				   uint32_t reg)
+{
+	return schema->strings + schema->regs[reg].name;
+}
+
+static inline const char *field_name(const struct soc_schema *schema,
+				     uint32_t field)
+{
+	return schema->strings + schema->fields[field].name;
+}
+
+static inline uint64_t field_mask(const struct soc_field *field)
+{
+	return (field->width < 64 ? (1ULL << field->width) - 1 : ~0ULL) <<
+	       field->lsb;
+}
+
+/*
+ * Lookup tables built once at mount time, unless the SOC file carries
+ * a perfect hash section. Both are open addressed with linear probing;
+ * the register table is keyed by the full "top/reg" path so a lookup
+ * costs a single hash of the request path.
+ */
+#define INDEX_EMPTY UINT32_MAX
+
+struct index_entry {
+	uint64_t hash;
+	uint32_t top;
+	uint32_t reg;
+};
+
+struct soc_index {
+	struct index_entry *tops;
+	uint32_t tops_mask;
+	struct index_entry *regs;
+	uint32_t regs_mask;
+};
+
+/*
+ * Runtime register table, indexed by register id. Everything needed to
+ * perform an access lives in its own naturally aligned array, so the
+ * access path doesn't pull names or other cold schema data into cache.
+ * virt is set for registers inside a permanently mapped aperture. The
+ * fields of register r are fields[first_field[r]] up to first_field[r+1].
+ *
+ * Writes and read-modify-writes are serialized by a lock picked by
+ * address, so aliases of one register share it. The same lock guards
+ * the cached values of constant and non-volatile registers, which are
+ * filled by their first read and kept up to date by writes, and the
+ * shadows of write-only registers, the last value written to them.
+ */
+#define REG_READABLE	(1 << 0)
+#define REG_WRITABLE	(1 << 1)
+#define REG_CONST	(1 << 2)
+#define REG_NONVOLATILE	(1 << 3)
+#define REG_CACHED	(REG_CONST | REG_NONVOLATILE)
+#define REG_READ_CLEAR	(1 << 4)
+#define REG_W1C		(1 << 5)
+
+#define REG_LOCK_STRIPES	64
+
+/*
+ * Single-flight reads of volatile registers. seq is odd while a read of
+ * the register is in flight; readers arriving meanwhile wait for it to
+ * move on and take value instead of reading the hardware themselves.
+ * Writes move it by two, so a flight older than the write isn't shared.
+ */
+struct reg_flight {
+	_Atomic uint64_t seq;
+	_Atomic uint64_t value;
+};
+
+struct reg_table {
+	uint64_t *addr;
+	void **virt;
+	uint8_t *width;
+	uint8_t *flags;
+	uint32_t *order;	/* register ids sorted by address */
+	uint32_t *first_field;
+	uint64_t *cache;
+	uint8_t *cache_valid;
+	struct reg_flight *flights;
+	uint32_t count;
+	pthread_mutex_t locks[REG_LOCK_STRIPES];
+	_Atomic uint64_t cache_hits;
+	_Atomic uint64_t cache_misses;
+	_Atomic uint64_t coalesced;
+	struct reg_sweep *sweeps;	/* per top, NULL unless enabled */
+	uint32_t *top;			/* top of every register, with sweeps */
+	uint64_t max_staleness_ns;
+	_Atomic uint64_t stale_hits;
+	_Atomic uint64_t sweep_count;
+};
+
+static inline pthread_mutex_t *reg_lock(struct reg_table *regs, uint32_t reg)
+{
+	return &regs->locks[(regs->addr[reg] >> 2) % REG_LOCK_STRIPES];
+}
+
+static inline uint32_t reg_field_count(const struct reg_table *regs,
+				       uint32_t reg)
+{
+	return regs->first_field[reg + 1] - regs->first_field[reg];
+}
+
+/*
+ * A register resolved once for the lifetime of an open file: its
+ * address is mapped up front, so accesses skip the mapping cache.
+ */
+struct reg_handle {
+	uint32_t reg;
+	uint8_t width;
+	uint8_t flags;
+	void *virt;
+	struct reg_table *regs;
+	struct mem_ref map;
+};
+
+/*
+ * A set of registers read together. Mapping it groups the registers
+ * outside of any aperture into runs by address, neighbours closer than
+ * APERTURE_MAX_GAP sharing one mapping, so reading the set afterwards
+ * only performs the bus accesses, back to back in set order.
+ */
+struct reg_run {
+	uint64_t start;
+	uint64_t end;
+	struct mem_ref map;
+	int mapped;
+};
+
+struct reg_set {
+	uint32_t *regs;
+	uint32_t count;
+	void **virt;
+	struct reg_run *runs;
+	uint32_t run_count;
+};
+
+/*
+ * The last sweep of a top, with --max_staleness_ms. Reads of the top's
+ * registers are served from it until it's older than the budget, then
+ * the first reader sweeps the whole top again while the others wait on
+ * the lock.
+ */
+struct reg_sweep {
+	pthread_mutex_t lock;
+	_Atomic uint64_t swept_ns;	/* 0 when expired */
+	uint32_t first_reg;
+	int mapped;
+	struct reg_set set;
+	uint64_t *values;		/* indexed by reg - first_reg */
+	uint64_t *valid;
+};
+
+struct soc_private {
+	struct soc_schema schema;
+	struct soc_index index;
+	struct reg_table regs;
+	struct mem_cache mem;
+	unsigned int cache_timeout;	/* seconds the kernel may cache names */
+	int dump_json;			/* format .all dumps as JSON */
+	unsigned int poll_interval_ms;	/* sampling period of polled registers */
+	struct watch *watch;
+	struct writeback *writeback;	/* posted writes, NULL unless enabled */
+};
+
+int soc_load(struct soc_schema *schema, const void *file, size_t size);
+
+int reg_table_init(struct reg_table *regs, const struct soc_schema *schema);
+void reg_table_map(struct reg_table *regs, struct mem_cache *mem);
+int reg_read(struct soc_private *private, uint32_t reg, uint64_t *value);
+int reg_write(struct soc_private *private, uint32_t reg, uint64_t value);
+int reg_fence(struct soc_private *private, uint32_t reg);
+void reg_invalidate(struct reg_table *regs, uint32_t reg);
+int reg_shadow(struct reg_table *regs, uint32_t reg, uint64_t *value);
+int reg_open(struct soc_private *private, uint32_t reg,
+	     struct reg_handle *handle);
+void reg_close(struct soc_private *private, struct reg_handle *handle);
+int reg_handle_read(struct reg_handle *handle, uint64_t *value);
+int reg_handle_shadow(struct reg_handle *handle, uint64_t *value);
+int reg_handle_write(struct reg_handle *handle, uint64_t value);
+int reg_update(struct soc_private *private, uint32_t reg, uint64_t mask,
+	       uint64_t bits, uint64_t *result);
+int reg_handle_update(struct reg_handle *handle, uint64_t mask, uint64_t bits,
+		      uint64_t *result);
+int reg_handle_toggle(struct reg_handle *handle, uint64_t mask);
+int reg_find_addr(struct reg_table *regs, uint64_t addr);
+int reg_sweep_init(struct soc_private *private, unsigned int max_staleness_ms);
+int reg_read_stale(struct soc_private *private, uint32_t reg,
+		   uint64_t *value);
+void reg_sweep_expire(struct reg_table *regs, uint32_t reg);
+int reg_set_map(struct soc_private *private, struct reg_set *set);
+void reg_set_unmap(struct soc_private *private, struct reg_set *set);
+void reg_set_read(struct soc_private *private, struct reg_set *set,
+		  uint64_t *values, uint64_t *valid);
+
+/* Posted writes, see writeback.c */
+int writeback_init(struct soc_private *private);
+int writeback_write(struct soc_private *private, uint32_t reg,
+		    uint64_t value);
+void writeback_drain(struct soc_private *private);
+int writeback_sync(struct soc_private *private);
+void writeback_stop(struct soc_private *private);
+
+struct socfs_ioc;
+
+int reg_ops(struct soc_private *private, struct reg_handle *self,
+	    struct socfs_ioc *ioc);
+
+size_t dump_size(const struct soc_schema *schema, uint32_t top);
+int dump_top(struct soc_private *private, uint32_t top, int json,
+	     char *data, size_t size);
+size_t snapshot_size(const struct soc_schema *schema);
+int snapshot_capture(struct soc_private *private, char *data, size_t size);
+
+int index_build(struct soc_index *index, const struct soc_schema *schema);
+int index_find_top(const struct soc_index *index,
+		   const struct soc_schema *schema, const char *name,
+		   size_t len);
+int index_find_reg(const struct soc_index *index,
+		   const struct soc_schema *schema, const char *path);
+int index_find_child(const struct soc_index *index,
+		     const struct soc_schema *schema, uint32_t top,
+		     const char *name);
+
+#endif /* SOC_H */
@@ -1,5 +1,60 @@
 #!/bin/env python3
 
+# All values are little endian.
+#
+# Version 2 (default):
+#
+# Header: (24 bytes)
+# u32 magic; // 0x57a32bcd
+# u32 version; // 2
+# u32 soc_name; // offset in the string section
+# u32 top_count;
+# u32 reg_count;
+# u32 section_count;
+# struct section[];
+#
+# section (4 + 4 + 8 + 8)
+# u32 type; // 1: strings, 2: tops, 3: regs, 4: perfect hash, 5: fields
+# u32 reserved;
+# u64 offset; // from the start of the file, 8 byte aligned
+# u64 size;
+#
+# top (4 + 4 + 4 + 4)
+# u32 name; // offset in the string section
+# u32 reg_count;
+# u32 first_reg; // index of the first register in the reg section
+# u32 reserved;
+#
+# reg (8 + 4 + 2 + 2)
+# u64 addr;
+# u32 name; // offset in the string section
+# u16 width;
+# u16 flags; // bit 0: constant, bit 1: non-volatile, bit 2: read-clear,
+#            // bits 3-4: access, 0: rw, 1: ro, 2: wo, 3: w1c
+#
+# field (4 + 4 + 1 + 1 + 2 + 4), sorted by register
+# u32 name; // offset in the string section
+# u32 reg; // register id
+# u8 lsb;
+# u8 width; // in bits
+# u16 access; // bit 0: readable, bit 1: writable
+# u32 reserved;
+#
+# The string section holds deduplicated NUL terminated names.
+#
+# perfect hash (4 + 4 + 4 * bucket_count + 4 * slot_count)
+# u32 bucket_count;
+# u32 slot_count; // top_count + reg_count
+# u32 seeds[bucket_count];
+# u32 slots[slot_count]; // reg id, or top id | 0x80000000
+#
+# Keys are top names and "top/reg" paths, hashed with 64 bit FNV-1a.
+# hash % bucket_count picks a bucket. A seed with bit 31 set holds the
+# slot itself, otherwise the slot is fmix64(hash ^ seed * 0x9e3779b97f4a7c15)
+# % slot_count, fmix64 being the MurmurHash3 finalizer.
+#
+# Version 1:
+#
 # Header: (44bytes)
 # u32 magic; // 0x57a32bcd
 # u32 version; // 1
@@ -22,9 +77,62 @@ import json
 import argparse
 from struct import *
 
+SOC_MAGIC = 0x57a32bcd
+
+SECTION_STRINGS = 1
+SECTION_TOPS = 2
+SECTION_REGS = 3
+SECTION_PHF = 4
+SECTION_FIELDS = 5
+
+REG_CONST = 1 << 0
+REG_NONVOLATILE = 1 << 1
+REG_READ_CLEAR = 1 << 2
+REG_VOLATILITY = {
+    'volatile': 0,
+    'nonvolatile': REG_NONVOLATILE,
+    'non-volatile': REG_NONVOLATILE,
+    'constant': REG_CONST,
+    'const': REG_CONST,
+    'read-clear': REG_READ_CLEAR,
+    'read-to-clear': REG_READ_CLEAR,
+}
+
+REG_ACCESS_SHIFT = 3
+REG_ACCESS = {
+    'read-write': 0,
+    'rw': 0,
+    'read-only': 1,
+    'ro': 1,
+    'write-only': 2,
+    'wo': 2,
+    'write-1-to-clear': 3,
+    'w1c': 3,
+}
+
+FIELD_READ = 1 << 0
+FIELD_WRITE = 1 << 1
+FIELD_ACCESS = {
+    'read-write': FIELD_READ | FIELD_WRITE,
+    'rw': FIELD_READ | FIELD_WRITE,
+    'read-only': FIELD_READ,
+    'ro': FIELD_READ,
+    'write-only': FIELD_WRITE,
+    'wo': FIELD_WRITE,
+}
+
+MASK64 = (1 << 64) - 1
+FNV_OFFSET_BASIS = 0xcbf29ce484222325
+FNV_PRIME = 0x100000001b3
+PHF_DIRECT = 0x80000000
+PHF_TOP = 0x80000000
+PHF_SEED_MULT = 0x9e3779b97f4a7c15
+
 parser = argparse.ArgumentParser()
 parser.add_argument('--input', '-i', type=argparse.FileType('r'), required=True)
 parser.add_argument('--output', '-o', type=argparse.FileType('wb'), required=True)
+parser.add_argument('--format-version', type=int, choices=[1, 2], default=2)
+parser.add_argument('--no-index', action='store_true', help="don't emit the perfect hash section (version 2)")
 options = parser.parse_args()
 
 with options.input:
@@ -33,18 +141,183 @@ with options.input:
     except ValueError as e:
         raise SystemExit(e)
 
-# Write header
-options.output.write(pack('<II32sI', 0x57a32bcd, 0x1, obj['Name'][:32].encode('ascii'), len(obj['RegisterLists'])))
 
-offset = 44
+class StringTable:
+    def __init__(self):
+        self.data = bytearray(b'\0')
+        self.offsets = {'': 0}
+
+    def add(self, name):
+        if name not in self.offsets:
+            self.offsets[name] = len(self.data)
+            self.data += name.encode('ascii') + b'\0'
+        return self.offsets[name]
+
+
+def fnv1a(data):
+    h = FNV_OFFSET_BASIS
+    for b in data:
+        h = ((h ^ b) * FNV_PRIME) & MASK64
+    return h
+
+
+def fmix64(h):
+    h ^= h >> 33
+    h = (h * 0xff51afd7ed558ccd) & MASK64
+    h ^= h >> 33
+    h = (h * 0xc4ceb9fe1a85ec53) & MASK64
+    h ^= h >> 33
+    return h
+
+
+def build_phf(keys):
+    """Hash and displace: place the largest buckets first, searching a seed
+    that sends all of a bucket's keys to free slots. Single key buckets
+    go last and take a free slot directly."""
+    # Identical keys can never get distinct slots, the seed search would spin
+    seen = set()
+    for key, value in keys:
+        if key in seen:
+            raise SystemExit("Duplicate name: %s" % key)
+        seen.add(key)
+
+    n = len(keys)
+    bucket_count = max(1, n // 2)
+    hashes = [fnv1a(key.encode('ascii')) for key, value in keys]
+    buckets = [[] for _ in range(bucket_count)]
+    for i, h in enumerate(hashes):
+        buckets[h % bucket_count].append(i)
+
+    seeds = [0] * bucket_count
+    slots = [None] * n
+    free = None
+
+    for b in sorted(range(bucket_count), key=lambda b: -len(buckets[b])):
+        members = buckets[b]
+        if not members:
+            break
+        if len(members) == 1:
+            if free is None:
+                free = [slot for slot in range(n) if slots[slot] is None]
+            slot = free.pop()
+            slots[slot] = keys[members[0]][1]
+            seeds[b] = PHF_DIRECT | slot
+            continue
+
+        seed = 1
+        while True:
+            mult = (seed * PHF_SEED_MULT) & MASK64
+            candidates = [fmix64(hashes[k] ^ mult) % n for k in members]
+            if len(set(candidates)) == len(candidates) and all(slots[c] is None for c in candidates):
+                break
+            seed += 1
+
+        seeds[b] = seed
+        for k, slot in zip(members, candidates):
+            slots[slot] = keys[k][1]
+
+    return pack('<II', bucket_count, n) + pack('<%dI' % bucket_count, *seeds) + pack('<%dI' % n, *slots)
+
+
+def align(data):
+    return data + bytes(-len(data) % 8)
+
+
+def reg_flags(register):
+    """Optional "Volatility" of a register: constant registers never
+    change, non-volatile ones only when written and read-clear ones when
+    read. Optional "Access": RW unless given, RO, WO or W1C."""
+    flags = REG_VOLATILITY.get(register.get('Volatility', 'volatile').lower())
+    if flags is None:
+        raise SystemExit("Invalid volatility: %s" % register['Name'])
+    access = REG_ACCESS.get(register.get('Access', 'read-write').lower())
+    if access is None:
+        raise SystemExit("Invalid access: %s" % register['Name'])
+    return flags | access << REG_ACCESS_SHIFT
+
+
+def pack_fields(register, reg_id, strings, reg_width):
+    """Optional "Fields" of a register: Name, Offset (lsb), Width in bits
+    and Access, read-write unless given."""
+    fields = bytearray()
+    names = set()
+    for field in register.get('Fields', []):
+        name = field['Name']
+        lsb = int(field['Offset'])
+        width = int(field.get('Width', 1))
+        access = FIELD_ACCESS.get(field.get('Access', 'read-write').lower())
+        if '/' in name or name.startswith('.') or name in names:
+            raise SystemExit("Invalid field name: %s/%s" % (register['Name'], name))
+        if access is None or width < 1 or lsb < 0 or lsb + width > reg_width:
+            raise SystemExit("Invalid field: %s/%s" % (register['Name'], name))
+        names.add(name)
+        fields += pack('<IIBBHI', strings.add(name), reg_id, lsb, width, access, 0)
+    return fields
+
+
+def write_v1(obj, output):
+    # Write header
+    output.write(pack('<II32sI', SOC_MAGIC, 0x1, obj['Name'][:32].encode('ascii'), len(obj['RegisterLists'])))
+
+    offset = 44
+
+    for top in obj['RegisterLists']:
+        # Write top header:
+        offset = offset + 40 + (len(top['Registers']) * 76)
+        output.write(pack('<32sII', top['Name'][:32].encode('ascii'), len(top['Registers']), offset))
+
+        for register in top['Registers']:
+            # Meanwhile we treat all regsiters as 32bit wide, which is wrong but it's difficult to detect it without
+            # diving to the bits, which is I don't want to do now.
+            output.write(pack('<64sqI', register['Name'][:64].encode('ascii'), int(register['Address'], 16), 32))
+
+
+def write_v2(obj, output):
+    strings = StringTable()
+    tops = bytearray()
+    regs = bytearray()
+    fields = bytearray()
+    reg_count = 0
+
+    keys = []
+
+    soc_name = strings.add(obj['Name'])
+
+    for top_id, top in enumerate(obj['RegisterLists']):
+        if '/' in top['Name']:
+            raise SystemExit("Invalid top name: %s" % top['Name'])
+        tops += pack('<IIII', strings.add(top['Name']), len(top['Registers']), reg_count, 0)
+        keys.append((top['Name'], top_id | PHF_TOP))
+
+        for register in top['Registers']:
+            if '/' in register['Name']:
+                raise SystemExit("Invalid register name: %s" % register['Name'])
+            # See write_v1() about the register width.
+            regs += pack('<QIHH', int(register['Address'], 16), strings.add(register['Name']), 32, reg_flags(register))
+            fields += pack_fields(register, reg_count, strings, 32)
+            keys.append((top['Name'] + '/' + register['Name'], reg_count))
+            reg_count += 1
+
+    sections = [(SECTION_TOPS, tops), (SECTION_REGS, regs), (SECTION_STRINGS, strings.data)]
+    if fields:
+        sections.append((SECTION_FIELDS, fields))
+    if keys and not options.no_index:
+        sections.append((SECTION_PHF, build_phf(keys)))
+
+    offset = 24 + 24 * len(sections)
+    table = bytearray()
+    for section_type, data in sections:
+        table += pack('<IIQQ', section_type, 0, offset, len(data))
+        offset += len(align(data))
 
-for top in obj['RegisterLists']:
-    # Write top header:
-    offset = offset + 40 + (len(top['Registers']) * 76)
-    options.output.write(pack('<32sII', top['Name'][:32].encode('ascii'), len(top['Registers']), offset))
+    output.write(pack('<IIIIII', SOC_MAGIC, 0x2, soc_name, len(obj['RegisterLists']), reg_count, len(sections)))
+    output.write(table)
+    for section_type, data in sections:
+        output.write(align(data))
 
-    for register in top['Registers']:
-        # Meanwhile we treat all regsiters as 32bit wide, which is wrong but it's difficult to detect it without
-        # diving to the bits, which is I don't want to do now.
-        options.output.write(pack('<64sqI', register['Name'][:64].encode('ascii'), int(register['Address'], 16), 32))
 
+with options.output:
+    if options.format_version == 1:
+        write_v1(obj, options.output)
+    else:
+        write_v2(obj, options.output)
@@ -0,0 +1,32 @@
+#ifndef SOCFS_H
+#define SOCFS_H
+
+#ifdef HAVE_FUSE3
+#define FUSE_USE_VERSION 31
+#else
+#define FUSE_USE_VERSION 29
+#endif
+
+#include <fuse.h>
+#include <stdio.h>
+#include "soc.h"
+
+#ifdef HAVE_FUSE2
+/* fuse_log is not available under FUSE2 */
+#define fuse_log(a,b,...) fprintf(stderr, b, ##__VA_ARGS__)
+#endif
+
+/*
+ * The namespace never changes during a mount, so by default the kernel
+ * keeps names and attributes for an hour.
+ */
+#define CACHE_TIMEOUT_DEFAULT	3600
+
+/* Sampling period of registers watched with poll(2) */
+#define POLL_INTERVAL_DEFAULT	100
+
+/* Implemented by the path based (FUSE2) or low level (FUSE3) frontend */
+void fuse_frontend_help(struct fuse_args *args);
+int fuse_frontend_main(struct fuse_args *args, struct soc_private *private);
+
+#endif /* SOCFS_H */
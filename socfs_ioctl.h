@@ -0,0 +1,58 @@
+#ifndef SOCFS_IOCTL_H
+#define SOCFS_IOCTL_H
+
+/*
+ * Binary register access, for programs that would rather skip the text
+ * interface. SOCFS_IOC_OPS is issued on the root directory or on any
+ * register file with a struct socfs_ioc, whose ops are executed in
+ * order in a single call. Results are returned in place: every executed
+ * op gets a status, read ops their value, and done counts the ops that
+ * succeeded. Execution stops at the first failing op.
+ */
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+enum socfs_op_code {
+	SOCFS_OP_READ,		/* value = register */
+	SOCFS_OP_WRITE,		/* register = value */
+	SOCFS_OP_SET,		/* register |= value, value = result */
+	SOCFS_OP_CLEAR,		/* register &= ~value, value = result */
+	SOCFS_OP_BARRIER,	/* complete all previous accesses */
+};
+
+/* Address the register by physical address rather than by id */
+#define SOCFS_OP_ADDR		(1 << 0)
+
+/* The register of the file the ioctl is issued on */
+#define SOCFS_REG_SELF		UINT32_MAX
+
+/*
+ * reg is the register's id, its index in the SOC file. With
+ * SOCFS_OP_ADDR, addr must instead be the address of a known register.
+ * width is 0 or the register's width in bytes.
+ */
+struct socfs_op {
+	uint64_t addr;
+	uint64_t value;
+	uint32_t reg;
+	uint8_t op;
+	uint8_t flags;
+	uint8_t width;
+	uint8_t reserved;
+	int32_t status;		/* out: 0 or a negative errno */
+	uint32_t reserved2;
+};
+
+#define SOCFS_IOC_MAX_OPS	64
+
+struct socfs_ioc {
+	uint32_t count;
+	uint32_t done;		/* out */
+	struct socfs_op ops[SOCFS_IOC_MAX_OPS];
+};
+
+#define SOCFS_IOC_MAGIC		'S'
+#define SOCFS_IOC_OPS		_IOWR(SOCFS_IOC_MAGIC, 1, struct socfs_ioc)
+
+#endif /* SOCFS_IOCTL_H */
@@ -0,0 +1,145 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <time.h>
+#include "soc.h"
+
+/*
+ * Bounded staleness reads, enabled with --max_staleness_ms. Register
+ * reads are served from the last sweep of their top while it's younger
+ * than the budget, so any number of monitoring clients cost at most one
+ * sweep per top and budget. Constant and non-volatile registers have
+ * their own cache, and read-clear registers are never swept: reading
+ * them behind the reader's back would lose their state.
+ */
+
+/* Marks a sweep in progress, older than any budget */
+#define SWEEP_RUNNING	1
+
+static uint64_t monotonic_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int sweepable(const struct reg_table *regs, uint32_t reg)
+{
+	return (regs->flags[reg] & REG_READABLE) &&
+	       !(regs->flags[reg] & (REG_CACHED | REG_READ_CLEAR));
+}
+
+int reg_sweep_init(struct soc_private *private, unsigned int max_staleness_ms)
+{
+	const struct soc_schema *schema = &private->schema;
+	struct reg_table *regs = &private->regs;
+	struct reg_sweep *sweep;
+	uint32_t top, i, count;
+
+	regs->sweeps = calloc(schema->top_count, sizeof(*regs->sweeps));
+	regs->top = calloc(regs->count, sizeof(*regs->top));
+	if ((schema->top_count && !regs->sweeps) || (regs->count && !regs->top))
+		return -ENOMEM;
+
+	for (top = 0; top < schema->top_count; top++) {
+		sweep = &regs->sweeps[top];
+		count = schema->tops[top].reg_count;
+
+		pthread_mutex_init(&sweep->lock, NULL);
+		sweep->first_reg = schema->tops[top].first_reg;
+		sweep->set.regs = calloc(count + 1, sizeof(*sweep->set.regs));
+		sweep->values = calloc(count + 1, sizeof(*sweep->values));
+		sweep->valid = calloc((count + 63) / 64 + 1,
+				      sizeof(*sweep->valid));
+		if (!sweep->set.regs || !sweep->values || !sweep->valid)
+			return -ENOMEM;
+
+		for (i = 0; i < count; i++) {
+			sweep->set.regs[i] = sweep->first_reg + i;
+			regs->top[sweep->first_reg + i] = top;
+		}
+		sweep->set.count = count;
+	}
+
+	regs->max_staleness_ns = max_staleness_ms * 1000000ULL;
+
+	return 0;
+}
+
+/*
+ * Read every sweepable register of the top, mapping it on the first
+ * sweep. Called with the sweep's lock held. The sweep is timestamped
+ * with its start, unless a write expired it in the meantime.
+ */
+static void sweep_top(struct soc_private *private, struct reg_sweep *sweep)
+{
+	struct reg_table *regs = &private->regs;
+	uint64_t start, running = SWEEP_RUNNING;
+	uint32_t i, reg;
+
+	if (!sweep->mapped) {
+		if (reg_set_map(private, &sweep->set))
+			return;
+		sweep->mapped = 1;
+	}
+
+	start = monotonic_ns();
+	atomic_store(&sweep->swept_ns, SWEEP_RUNNING);
+
+	for (i = 0; i < sweep->set.count; i++) {
+		reg = sweep->set.regs[i];
+		if (!sweepable(regs, reg) || !sweep->set.virt[i]) {
+			sweep->valid[i / 64] &= ~(1ULL << (i % 64));
+			continue;
+		}
+		sweep->values[i] = mem_read(sweep->set.virt[i],
+					    regs->width[reg]);
+		sweep->valid[i / 64] |= 1ULL << (i % 64);
+	}
+
+	atomic_compare_exchange_strong(&sweep->swept_ns, &running, start);
+	atomic_fetch_add(&regs->sweep_count, 1);
+}
+
+/*
+ * Read a register from its top's last sweep, sweeping the top again if
+ * that's older than the budget. Fails with -EAGAIN when the register
+ * must be read directly instead.
+ */
+int reg_read_stale(struct soc_private *private, uint32_t reg,
+		   uint64_t *value)
+{
+	struct reg_table *regs = &private->regs;
+	struct reg_sweep *sweep;
+	uint64_t swept;
+	uint32_t i;
+	int ret = -EAGAIN;
+
+	if (!regs->sweeps || !sweepable(regs, reg))
+		return -EAGAIN;
+
+	sweep = &regs->sweeps[regs->top[reg]];
+	i = reg - sweep->first_reg;
+
+	pthread_mutex_lock(&sweep->lock);
+	swept = atomic_load(&sweep->swept_ns);
+	if (swept && monotonic_ns() - swept < regs->max_staleness_ns)
+		atomic_fetch_add(&regs->stale_hits, 1);
+	else
+		sweep_top(private, sweep);
+
+	if (sweep->valid[i / 64] & (1ULL << (i % 64))) {
+		*value = sweep->values[i];
+		ret = 0;
+	}
+	pthread_mutex_unlock(&sweep->lock);
+
+	return ret;
+}
+
+/* Writes make the next read of the top sweep it again */
+void reg_sweep_expire(struct reg_table *regs, uint32_t reg)
+{
+	if (regs->sweeps)
+		atomic_store(&regs->sweeps[regs->top[reg]].swept_ns, 0);
+}
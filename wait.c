@@ -0,0 +1,148 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "misc.h"
+#include "node.h"
+
+/*
+ * The /.wait control file. A write of "top/reg mask expected timeout_ms
+ * [backoff_us]" blocks until (value & mask) == expected, polling the
+ * register mapped once for the whole wait, or fails with ETIMEDOUT.
+ * The register is polled in a tight loop for WAIT_SPIN_NS, then with
+ * sleeps doubling from 1us up to backoff_us; a backoff of 0 spins for
+ * the whole wait. Reading the file returns the outcome of the last
+ * wait on the open file.
+ */
+
+#define WAIT_SPIN_NS		20000
+#define WAIT_BACKOFF_DEFAULT	1000	/* us */
+
+struct waiter {
+	int done;
+	int met;
+	uint64_t value;
+	uint64_t elapsed_ns;
+	uint64_t iterations;
+};
+
+struct waiter *waiter_new(void)
+{
+	return calloc(1, sizeof(struct waiter));
+}
+
+void waiter_free(struct waiter *waiter)
+{
+	free(waiter);
+}
+
+static uint64_t monotonic_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_ns(uint64_t ns)
+{
+	struct timespec ts = { ns / 1000000000ULL, ns % 1000000000ULL };
+
+	nanosleep(&ts, NULL);
+}
+
+static int waiter_poll(struct waiter *waiter, struct reg_handle *reg,
+		       uint64_t mask, uint64_t expected, uint64_t timeout_ns,
+		       uint64_t backoff_ns)
+{
+	uint64_t start = monotonic_ns(), now = start, sleep = 1000;
+	int ret;
+
+	waiter->iterations = 0;
+	for (;;) {
+		ret = reg_handle_read(reg, &waiter->value);
+		if (ret)
+			return ret;
+		waiter->iterations++;
+
+		waiter->met = (waiter->value & mask) == expected;
+		if (waiter->met || now - start >= timeout_ns)
+			break;
+
+		now = monotonic_ns();
+		if (backoff_ns && now - start >= WAIT_SPIN_NS &&
+		    now - start < timeout_ns) {
+			if (sleep > backoff_ns)
+				sleep = backoff_ns;
+			if (sleep > start + timeout_ns - now)
+				sleep = start + timeout_ns - now;
+			sleep_ns(sleep);
+			sleep *= 2;
+			now = monotonic_ns();
+		}
+	}
+
+	waiter->elapsed_ns = monotonic_ns() - start;
+	waiter->done = 1;
+
+	return waiter->met ? 0 : -ETIMEDOUT;
+}
+
+int waiter_write(struct soc_private *private, struct waiter *waiter,
+		 const char *buf, size_t size)
+{
+	uint64_t mask, expected, timeout, backoff = WAIT_BACKOFF_DEFAULT;
+	char line[LINE_BUF_MAX], *args[5], *path, *save;
+	struct reg_handle handle;
+	int count = 0, reg, ret;
+
+	/* The request buffer isn't NUL terminated */
+	if (size >= sizeof(line))
+		return -EINVAL;
+	memcpy(line, buf, size);
+	line[size] = '\0';
+
+	for (path = strtok_r(line, " \t\n", &save); path && count < 5;
+	     path = strtok_r(NULL, " \t\n", &save))
+		args[count++] = path;
+	if (path || count < 4 || parse_input(args[1], &mask) ||
+	    parse_input(args[2], &expected) || parse_input(args[3], &timeout) ||
+	    (count == 5 && parse_input(args[4], &backoff)))
+		return -EINVAL;
+
+	path = args[0];
+	if (*path == '/')
+		path++;
+	reg = index_find_reg(&private->index, &private->schema, path);
+	if (reg < 0)
+		return -ENOENT;
+
+	if (timeout > UINT64_MAX / 1000000)
+		timeout = UINT64_MAX / 1000000;
+	if (backoff > UINT64_MAX / 1000)
+		backoff = UINT64_MAX / 1000;
+
+	ret = reg_open(private, reg, &handle);
+	if (ret)
+		return ret;
+
+	ret = waiter_poll(waiter, &handle, mask, expected, timeout * 1000000,
+			  backoff * 1000);
+	reg_close(private, &handle);
+
+	return ret ? ret : size;
+}
+
+int waiter_show(struct waiter *waiter, char *buf, size_t size)
+{
+	if (!waiter->done)
+		return 0;
+
+	return snprintf(buf, size,
+			"result: %s\nvalue: 0x%" PRIx64 "\n"
+			"elapsed_ns: %" PRIu64 "\niterations: %" PRIu64 "\n",
+			waiter->met ? "met" : "timeout", waiter->value,
+			waiter->elapsed_ns, waiter->iterations);
+}
@@ -0,0 +1,301 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <time.h>
+#include "node.h"
+
+/*
+ * Change notification for poll(2) on register files. A register polled
+ * through at least one open file is subscribed, and a sampler thread
+ * reads every subscribed register once per interval, however many files
+ * watch it. A change bumps the register's generation and wakes the
+ * files waiting on it. A file is readable while the generation differs
+ * from the one its last read saw.
+ */
+
+struct watch_reg {
+	uint32_t reg;
+	int valid;
+	uint64_t value;
+	uint64_t gen;
+	struct node_handle *handles;
+};
+
+/* A register read by the sampler, with the lock dropped */
+struct watch_sample {
+	uint32_t reg;
+	int ok;
+	uint64_t value;
+};
+
+struct watch {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+	int running;
+	int stop;
+	unsigned int interval_ms;
+	watch_fn_t notify;
+	watch_fn_t destroy;
+	struct watch_reg *regs;
+	uint32_t count;
+	uint32_t capacity;
+};
+
+int watch_init(struct soc_private *private, watch_fn_t notify,
+	       watch_fn_t destroy)
+{
+	struct watch *watch;
+	pthread_condattr_t attr;
+
+	watch = calloc(1, sizeof(*watch));
+	if (!watch)
+		return -ENOMEM;
+
+	pthread_mutex_init(&watch->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&watch->cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	watch->interval_ms = private->poll_interval_ms ?
+			     private->poll_interval_ms : 1;
+	watch->notify = notify;
+	watch->destroy = destroy;
+	private->watch = watch;
+
+	return 0;
+}
+
+static struct watch_reg *watch_find(struct watch *watch, uint32_t reg)
+{
+	uint32_t i;
+
+	for (i = 0; i < watch->count; i++)
+		if (watch->regs[i].reg == reg)
+			return &watch->regs[i];
+
+	return NULL;
+}
+
+/*
+ * Every tick, the subscribed registers are listed under the lock but
+ * read without it, so polls and releases don't wait for the bus. A
+ * register unsubscribed meanwhile is skipped when publishing.
+ */
+static void *watch_sampler(void *arg)
+{
+	struct soc_private *private = arg;
+	struct watch *watch = private->watch;
+	struct watch_sample *samples = NULL, *grown;
+	struct node_handle *handle;
+	struct watch_reg *entry;
+	struct timespec deadline;
+	uint32_t count, capacity = 0, i;
+
+	pthread_mutex_lock(&watch->lock);
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+	while (!watch->stop) {
+		deadline.tv_nsec += watch->interval_ms % 1000 * 1000000L;
+		deadline.tv_sec += watch->interval_ms / 1000 +
+				   deadline.tv_nsec / 1000000000L;
+		deadline.tv_nsec %= 1000000000L;
+		while (!watch->stop &&
+		       pthread_cond_timedwait(&watch->cond, &watch->lock,
+					      &deadline) != ETIMEDOUT)
+			;
+		if (watch->stop)
+			break;
+
+		count = watch->count;
+		if (count > capacity) {
+			grown = realloc(samples, count * sizeof(*samples));
+			if (!grown)
+				continue;
+			samples = grown;
+			capacity = count;
+		}
+		for (i = 0; i < count; i++)
+			samples[i].reg = watch->regs[i].reg;
+		pthread_mutex_unlock(&watch->lock);
+
+		for (i = 0; i < count; i++)
+			samples[i].ok = !reg_read(private, samples[i].reg,
+						  &samples[i].value);
+
+		pthread_mutex_lock(&watch->lock);
+		for (i = 0; i < count && !watch->stop; i++) {
+			entry = watch_find(watch, samples[i].reg);
+			if (!entry || !samples[i].ok ||
+			    (entry->valid && samples[i].value == entry->value))
+				continue;
+
+			entry->value = samples[i].value;
+			if (!entry->valid) {
+				entry->valid = 1;
+				continue;
+			}
+
+			entry->gen++;
+			for (handle = entry->handles; handle;
+			     handle = handle->watch_next) {
+				if (!handle->poll_handle)
+					continue;
+				watch->notify(handle->poll_handle);
+				handle->poll_handle = NULL;
+			}
+		}
+	}
+
+	pthread_mutex_unlock(&watch->lock);
+	free(samples);
+
+	return NULL;
+}
+
+/* valid and value are the register's first sample, read by the caller */
+static int watch_subscribe(struct soc_private *private,
+			   struct node_handle *handle, int valid,
+			   uint64_t value)
+{
+	struct watch *watch = private->watch;
+	struct watch_reg *entry, *regs;
+	uint32_t reg = handle->reg.reg;
+
+	entry = watch_find(watch, reg);
+	if (!entry) {
+		if (watch->count == watch->capacity) {
+			watch->capacity = watch->capacity ?
+					  2 * watch->capacity : 16;
+			regs = realloc(watch->regs,
+				       watch->capacity * sizeof(*regs));
+			if (!regs)
+				return -ENOMEM;
+			watch->regs = regs;
+		}
+
+		entry = &watch->regs[watch->count++];
+		entry->reg = reg;
+		entry->gen = 0;
+		entry->handles = NULL;
+		entry->valid = valid;
+		entry->value = value;
+	}
+
+	if (!watch->running) {
+		if (watch->stop ||
+		    pthread_create(&watch->thread, NULL, watch_sampler,
+				   private)) {
+			if (!entry->handles)
+				*entry = watch->regs[--watch->count];
+			return -EAGAIN;
+		}
+		watch->running = 1;
+	}
+
+	handle->watch_next = entry->handles;
+	entry->handles = handle;
+	handle->watch_gen = entry->gen;
+	handle->watched = 1;
+
+	return 0;
+}
+
+/*
+ * Subscribe the handle's register if needed and keep ph, the frontend's
+ * poll handle, to be notified on the next change. Returns 1 if the
+ * register changed since the handle's last read.
+ */
+int watch_poll(struct soc_private *private, struct node_handle *handle,
+	       void *ph)
+{
+	struct watch *watch = private->watch;
+	struct watch_reg *entry;
+	uint64_t value = 0;
+	int valid = 0, ret = 0;
+
+	/* Sample a new subscription without stalling the sampler and polls */
+	if (!handle->watched)
+		valid = !reg_read(private, handle->reg.reg, &value);
+
+	pthread_mutex_lock(&watch->lock);
+
+	if (!handle->watched)
+		ret = watch_subscribe(private, handle, valid, value);
+
+	if (!ret) {
+		entry = watch_find(watch, handle->reg.reg);
+		ret = entry->gen != handle->watch_gen;
+		if (ph) {
+			if (handle->poll_handle)
+				watch->destroy(handle->poll_handle);
+			handle->poll_handle = ph;
+			ph = NULL;
+		}
+	}
+
+	pthread_mutex_unlock(&watch->lock);
+
+	if (ph)
+		watch->destroy(ph);
+
+	return ret;
+}
+
+/* The handle's read saw the register's latest change */
+void watch_seen(struct soc_private *private, struct node_handle *handle)
+{
+	struct watch *watch = private->watch;
+
+	pthread_mutex_lock(&watch->lock);
+	handle->watch_gen = watch_find(watch, handle->reg.reg)->gen;
+	pthread_mutex_unlock(&watch->lock);
+}
+
+/* Drop a poll handle that won't be waited on */
+void watch_drop(struct soc_private *private, void *ph)
+{
+	if (ph)
+		private->watch->destroy(ph);
+}
+
+void watch_release(struct soc_private *private, struct node_handle *handle)
+{
+	struct watch *watch = private->watch;
+	struct node_handle **pos;
+	struct watch_reg *entry;
+
+	pthread_mutex_lock(&watch->lock);
+
+	entry = watch_find(watch, handle->reg.reg);
+	for (pos = &entry->handles; *pos != handle; pos = &(*pos)->watch_next)
+		;
+	*pos = handle->watch_next;
+	if (!entry->handles)
+		*entry = watch->regs[--watch->count];
+
+	if (handle->poll_handle)
+		watch->destroy(handle->poll_handle);
+	handle->poll_handle = NULL;
+	handle->watched = 0;
+
+	pthread_mutex_unlock(&watch->lock);
+}
+
+/* Stop the sampler before the frontend's session goes away */
+void watch_stop(struct soc_private *private)
+{
+	struct watch *watch = private->watch;
+
+	if (!watch)
+		return;
+
+	pthread_mutex_lock(&watch->lock);
+	watch->stop = 1;
+	pthread_cond_signal(&watch->cond);
+	pthread_mutex_unlock(&watch->lock);
+
+	if (watch->running)
+		pthread_join(watch->thread, NULL);
+	watch->running = 0;
+}
@@ -0,0 +1,198 @@
+#include <errno.h>
+#include <stdlib.h>
+#include "soc.h"
+
+/*
+ * Posted register writes, enabled with --writeback. Plain writes to
+ * register files and /.batch lines are queued and return at once; a
+ * writer thread applies them in order. A write following one to the
+ * same non-volatile register replaces it in the queue, as only the last
+ * value of such a register is observable. Every other access drains the
+ * queue first, so it sees the effect of all earlier writes, and a sync
+ * drains it and reads a written register back, so the posted writes
+ * reached the device. Errors are kept until the next sync reports them.
+ */
+
+#define WRITEBACK_QUEUE_SIZE	4096
+
+struct writeback_entry {
+	uint32_t reg;
+	uint64_t value;
+};
+
+struct writeback {
+	pthread_mutex_t lock;
+	pthread_cond_t work;	/* entries queued, or stopping */
+	pthread_cond_t idle;	/* an entry was written */
+	pthread_t thread;
+	int running;
+	int stop;
+	int busy;		/* an entry is being written */
+	int err;		/* first error since the last sync */
+	int64_t fence_reg;	/* last written register safe to read back */
+	uint32_t head;
+	uint32_t count;
+	struct writeback_entry queue[WRITEBACK_QUEUE_SIZE];
+};
+
+int writeback_init(struct soc_private *private)
+{
+	struct writeback *wb;
+
+	wb = calloc(1, sizeof(*wb));
+	if (!wb)
+		return -ENOMEM;
+
+	pthread_mutex_init(&wb->lock, NULL);
+	pthread_cond_init(&wb->work, NULL);
+	pthread_cond_init(&wb->idle, NULL);
+	wb->fence_reg = -1;
+	private->writeback = wb;
+
+	return 0;
+}
+
+static void *writeback_thread(void *arg)
+{
+	struct soc_private *private = arg;
+	struct writeback *wb = private->writeback;
+	struct writeback_entry entry;
+	uint8_t flags;
+	int ret;
+
+	pthread_mutex_lock(&wb->lock);
+	for (;;) {
+		while (!wb->count && !wb->stop)
+			pthread_cond_wait(&wb->work, &wb->lock);
+		if (!wb->count)
+			break;
+
+		entry = wb->queue[wb->head];
+		wb->head = (wb->head + 1) % WRITEBACK_QUEUE_SIZE;
+		wb->count--;
+		wb->busy = 1;
+		pthread_mutex_unlock(&wb->lock);
+
+		ret = reg_write(private, entry.reg, entry.value);
+		flags = private->regs.flags[entry.reg];
+
+		pthread_mutex_lock(&wb->lock);
+		wb->busy = 0;
+		if (ret && !wb->err)
+			wb->err = ret;
+		else if (!ret && (flags & REG_READABLE) &&
+			 !(flags & REG_READ_CLEAR))
+			wb->fence_reg = entry.reg;
+		pthread_cond_broadcast(&wb->idle);
+	}
+	pthread_mutex_unlock(&wb->lock);
+
+	return NULL;
+}
+
+/*
+ * Queue a write, or perform it when write-back is disabled. The thread
+ * is only started by the first write, as FUSE may fork to daemonize
+ * after the filesystem was set up.
+ */
+int writeback_write(struct soc_private *private, uint32_t reg,
+		    uint64_t value)
+{
+	struct writeback *wb = private->writeback;
+	struct writeback_entry *tail;
+
+	if (!wb)
+		return reg_write(private, reg, value);
+	if (!(private->regs.flags[reg] & REG_WRITABLE))
+		return -EACCES;
+
+	pthread_mutex_lock(&wb->lock);
+	if (!wb->running) {
+		if (pthread_create(&wb->thread, NULL, writeback_thread,
+				   private)) {
+			pthread_mutex_unlock(&wb->lock);
+			return reg_write(private, reg, value);
+		}
+		wb->running = 1;
+	}
+
+	while (wb->count == WRITEBACK_QUEUE_SIZE)
+		pthread_cond_wait(&wb->idle, &wb->lock);
+
+	tail = &wb->queue[(wb->head + wb->count + WRITEBACK_QUEUE_SIZE - 1) %
+			  WRITEBACK_QUEUE_SIZE];
+	if (wb->count && tail->reg == reg &&
+	    (private->regs.flags[reg] & REG_NONVOLATILE)) {
+		tail->value = value;
+	} else {
+		tail = &wb->queue[(wb->head + wb->count) %
+				  WRITEBACK_QUEUE_SIZE];
+		tail->reg = reg;
+		tail->value = value;
+		wb->count++;
+		pthread_cond_signal(&wb->work);
+	}
+	pthread_mutex_unlock(&wb->lock);
+
+	return 0;
+}
+
+/* Wait until every queued write was performed */
+void writeback_drain(struct soc_private *private)
+{
+	struct writeback *wb = private->writeback;
+
+	if (!wb)
+		return;
+
+	pthread_mutex_lock(&wb->lock);
+	while (wb->count || wb->busy)
+		pthread_cond_wait(&wb->idle, &wb->lock);
+	pthread_mutex_unlock(&wb->lock);
+}
+
+/*
+ * Drain the queue, then read back the last written register that can
+ * be read without side effects, so the posted writes have landed.
+ * Returns the first error since the last sync.
+ */
+int writeback_sync(struct soc_private *private)
+{
+	struct writeback *wb = private->writeback;
+	int64_t fence_reg;
+	int err;
+
+	if (!wb)
+		return 0;
+
+	pthread_mutex_lock(&wb->lock);
+	while (wb->count || wb->busy)
+		pthread_cond_wait(&wb->idle, &wb->lock);
+	err = wb->err;
+	wb->err = 0;
+	fence_reg = wb->fence_reg;
+	pthread_mutex_unlock(&wb->lock);
+
+	if (fence_reg >= 0 && reg_fence(private, fence_reg) && !err)
+		err = -EIO;
+
+	return err;
+}
+
+/* Apply what's still queued and stop the thread */
+void writeback_stop(struct soc_private *private)
+{
+	struct writeback *wb = private->writeback;
+
+	if (!wb)
+		return;
+
+	pthread_mutex_lock(&wb->lock);
+	wb->stop = 1;
+	pthread_cond_signal(&wb->work);
+	pthread_mutex_unlock(&wb->lock);
+
+	if (wb->running)
+		pthread_join(wb->thread, NULL);
+	wb->running = 0;
+}